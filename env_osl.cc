@@ -1,6 +1,8 @@
 #include <sys/time.h>
 #include <iostream>
 #include <memory>
+#include <random>
+#include <set>
 #include "env_osl.h"
 #include "rocksdb/options.h"
 #include "rocksdb/slice.h"
@@ -13,37 +15,92 @@ namespace rocksdb
 	{
 	}
 
+	void OSLFile::RecordRead(uint64_t offset, size_t n)
+	{
+		if (n == 0)
+		{
+			return;
+		}
+
+		size_t first = offset / OSL_HEAT_REGION;
+		size_t last = (offset + n - 1) / OSL_HEAT_REGION;
+		std::lock_guard<std::mutex> lock(heat_mutex);
+
+		if (heat.size() <= last)
+		{
+			heat.resize(last + 1, 0);
+		}
+		for (size_t i = first; i <= last; i++)
+		{
+			heat[i]++;
+		}
+		temperature++;
+	}
+
+	std::uint64_t OSLEnv::NewEnvId()
+	{
+		std::random_device rd;
+		std::uint64_t id = ((std::uint64_t)rd() << 32) | rd();
+		return id ^ Env::Default()->NowMicros();
+	}
+
+	/* Returns fname's file with a reference taken, or NULL if it is not
+	 * on the device. */
+	OSLFile *OSLEnv::RefFile(const std::string &fname)
+	{
+		std::lock_guard<std::mutex> lock(files_mutex);
+
+		auto it = files.find(fname);
+		if (it == files.end() || it->second == NULL)
+		{
+			return NULL;
+		}
+
+		it->second->Ref();
+		return it->second;
+	}
+
+	void OSLEnv::UnrefFile(OSLFile *oslfile)
+	{
+		if (oslfile == NULL ||
+				oslfile->refs.fetch_sub(1, std::memory_order_acq_rel) != 1)
+		{
+			return;
+		}
+
+		std::lock_guard<std::mutex> lock(files_mutex);
+		ReleaseFile(oslfile);
+	}
+
 	Status OSLEnv::NewSequentialFile(const std::string &fname,
 			std::unique_ptr<SequentialFile> *result,
 			const EnvOptions &options)
 	{
+		OSLFile *oslfile = IsFilePosix(fname) ? NULL : RefFile(fname);
 
-		if (IsFilePosix(fname) || files[fname] == NULL)
+		if (oslfile == NULL)
 		{
 			return posixEnv->NewSequentialFile(fname, result, options);
 		}
 
-		result->reset();
-
-		OSLSequentialFile *f = new OSLSequentialFile(fname, this, options);
-		result->reset(dynamic_cast<SequentialFile *>(f));
-
+		result->reset(new OSLSequentialFile(oslfile, this, options));
 		return Status::OK();
 	}
 
+	/* The table cache reopens files at a high rate: one map lookup, a
+	 * pooled handle and no copy of the name. */
 	Status OSLEnv::NewRandomAccessFile(const std::string &fname,
 			std::unique_ptr<RandomAccessFile> *result,
 			const EnvOptions &options)
 	{
+		OSLFile *oslfile = IsFilePosix(fname) ? NULL : RefFile(fname);
 
-		if (IsFilePosix(fname))
+		if (oslfile == NULL)
 		{
 			return posixEnv->NewRandomAccessFile(fname, result, options);
 		}
 
-		OSLRandomAccessFile *f = new OSLRandomAccessFile(fname, this, options);
-		result->reset(dynamic_cast<RandomAccessFile *>(f));
-
+		result->reset(new OSLRandomAccessFile(oslfile, this, options));
 		return Status::OK();
 	}
 
@@ -51,32 +108,30 @@ namespace rocksdb
 			std::unique_ptr<WritableFile> *result,
 			const EnvOptions &options)
 	{
-
-		uint32_t fileNum = 0;
-
 		if (IsFilePosix(fname))
 		{
 			return posixEnv->NewWritableFile(fname, result, options);
 		}
-		else
-		{
-			posixEnv->NewWritableFile(fname, result, options);
-		}
 
-		fileNum = files.count(fname);
+		OSLFile *oslfile = new OSLFile(fname);
+		oslfile->modification_time = NowSeconds();
+		oslfile->block_pages = BlockPagesFor(fname);
 
-		if (fileNum != 0)
+		/* One reference for the name, one for the handle. */
+		oslfile->Ref();
 		{
-			delete files[fname];
-			files.erase(fname);
-		}
-
-		files[fname] = new OSLFile(fname);
-		files[fname]->uuididx = uuididx++;
+			std::lock_guard<std::mutex> lock(files_mutex);
 
-		OSLWritableFile *f = new OSLWritableFile(fname, this, options);
-		result->reset(dynamic_cast<WritableFile *>(f));
+			if (files.count(fname) != 0)
+			{
+				UnlinkFile(fname);
+			}
+			oslfile->uuididx = uuididx++;
+			files[fname] = oslfile;
+			LogName(oslfile, fname);
+		}
 
+		result->reset(new OSLWritableFile(fname, oslfile, this, options));
 		return Status::OK();
 	}
 
@@ -86,23 +141,65 @@ namespace rocksdb
 		{
 			return posixEnv->DeleteFile(fname);
 		}
-		posixEnv->DeleteFile(fname);
 
-		if (files.find(fname) == files.end() || files[fname] == NULL)
 		{
-			return Status::OK();
+			std::lock_guard<std::mutex> lock(files_mutex);
+
+			if (files.find(fname) == files.end())
+			{
+				return posixEnv->DeleteFile(fname);
+			}
+
+			UnlinkFile(fname);
 		}
 
-		OSLFile *oslfile = files[fname];
+		/* Deletions are what leave pack segments mostly dead. */
+		CollectPackSegments();
+		return Status::OK();
+	}
 
-		for (auto it = oslfile->lbas.begin(); it != oslfile->lbas.end(); it++)
+	/* Drops one name; the extents go back to the allocator with the last. */
+	void OSLEnv::UnlinkFile(const std::string &fname)
+	{
+		auto it = files.find(fname);
+		if (it == files.end())
 		{
-			free_lbas.push(*it);
+			return;
 		}
 
-		delete files[fname];
-		files.erase(fname);
-		return Status::OK();
+		OSLFile *oslfile = it->second;
+		files.erase(it);
+		LogUnname(fname);
+
+		if (oslfile == NULL)
+		{
+			return;
+		}
+
+		/* Open handles keep a deleted file readable until they close. */
+		oslfile->links--;
+		if (oslfile->refs.fetch_sub(1, std::memory_order_acq_rel) == 1)
+		{
+			ReleaseFile(oslfile);
+		}
+	}
+
+	/* Called with files_mutex held once the last reference is gone. */
+	void OSLEnv::ReleaseFile(OSLFile *oslfile)
+	{
+		if (oslfile->local)
+		{
+			oslfile->local.reset();
+			posixEnv->DeleteFile(oslfile->local_path);
+			tier_bytes -= oslfile->synced_size;
+		}
+		if (oslfile->packed)
+		{
+			ReleasePacked(oslfile->pack_segment, oslfile->pack_length);
+		}
+		ErasePages(oslfile, 0);
+		FreeLBAs(oslfile->lbas, oslfile->block_pages);
+		delete oslfile;
 	}
 
 	Status OSLEnv::GetFileSize(const std::string &fname, std::uint64_t *size)
@@ -112,12 +209,15 @@ namespace rocksdb
 			return posixEnv->GetFileSize(fname, size);
 		}
 
-		if (files.find(fname) == files.end() || files[fname] == NULL)
+		std::lock_guard<std::mutex> lock(files_mutex);
+
+		auto it = files.find(fname);
+		if (it == files.end())
 		{
-			return Status::OK();
+			return posixEnv->GetFileSize(fname, size);
 		}
 
-		*size = files[fname]->size;
+		*size = it->second->size;
 
 		return Status::OK();
 	}
@@ -131,7 +231,15 @@ namespace rocksdb
 			return posixEnv->GetFileModificationTime(fname, file_mtime);
 		}
 
-		*file_mtime = 0;
+		std::lock_guard<std::mutex> lock(files_mutex);
+
+		auto it = files.find(fname);
+		if (it == files.end())
+		{
+			return posixEnv->GetFileModificationTime(fname, file_mtime);
+		}
+
+		*file_mtime = it->second->modification_time;
 
 		return Status::OK();
 	}
@@ -145,21 +253,267 @@ namespace rocksdb
 			return posixEnv->RenameFile(src, target);
 		}
 
-		posixEnv->RenameFile(src, target);
+		std::lock_guard<std::mutex> lock(files_mutex);
 
-		if (files.find(src) == files.end() || files[src] == NULL)
+		if (files.find(src) == files.end())
 		{
-			return Status::OK();
+			return posixEnv->RenameFile(src, target);
 		}
 
 		OSLFile *osl = files[src];
+		if (files.count(target) != 0)
+		{
+			/* Like rename(2), two names of the same file stay as they are. */
+			if (files[target] == osl)
+			{
+				return Status::OK();
+			}
+			UnlinkFile(target);
+		}
+
 		osl->name = target;
 		files[target] = osl;
 		files.erase(src);
+		LogName(osl, target);
+		LogUnname(src);
 
 		return Status::OK();
 	}
 
+	/* Checkpoints and backups link SSTs instead of copying them; the new name
+	 * shares the LBAs of src and costs no device I/O. */
+	Status OSLEnv::LinkFile(const std::string &src, const std::string &target)
+	{
+		if (IsFilePosix(src))
+		{
+			return posixEnv->LinkFile(src, target);
+		}
+
+		std::lock_guard<std::mutex> lock(files_mutex);
+
+		if (files.find(src) == files.end())
+		{
+			return posixEnv->LinkFile(src, target);
+		}
+
+		if (files.count(target) != 0)
+		{
+			return Status::IOError("OSL link target exists", target);
+		}
+
+		OSLFile *osl = files[src];
+		osl->links++;
+		osl->Ref();
+		files[target] = osl;
+		LogName(osl, target);
+
+		return Status::OK();
+	}
+
+	Status OSLEnv::FileExists(const std::string &fname)
+	{
+		if (!IsFilePosix(fname))
+		{
+			std::lock_guard<std::mutex> lock(files_mutex);
+
+			if (files.find(fname) != files.end())
+			{
+				return Status::OK();
+			}
+		}
+
+		return posixEnv->FileExists(fname);
+	}
+
+	/* Directories live in the posix tree; the device files in them are
+	 * only known to the namespace, so the two listings are merged. */
+	Status OSLEnv::GetChildren(const std::string &path,
+			std::vector<std::string> *result)
+	{
+		Status s = posixEnv->GetChildren(path, result);
+		if (!s.ok())
+		{
+			return s;
+		}
+
+		std::string dir = path;
+		while (dir.size() > 1 && dir.back() == '/')
+		{
+			dir.pop_back();
+		}
+
+		std::set<std::string> seen(result->begin(), result->end());
+		std::lock_guard<std::mutex> lock(files_mutex);
+
+		for (auto it = files.begin(); it != files.end(); it++)
+		{
+			size_t slash = it->first.rfind('/');
+			if (slash == std::string::npos || it->first.compare(0, slash, dir) != 0 ||
+					slash != dir.size())
+			{
+				continue;
+			}
+
+			std::string child = it->first.substr(slash + 1);
+			if (seen.insert(child).second)
+			{
+				result->push_back(child);
+			}
+		}
+
+		return Status::OK();
+	}
+
+	Status OSLEnv::RegisterFile(const std::string &fname, std::uint64_t size,
+			const uint32_t *lbas, const uint32_t *crcs, size_t nlbas)
+	{
+		if ((size + OSL_ALIGMENT - 1) / OSL_ALIGMENT != nlbas)
+		{
+			return Status::Corruption("OSL extent does not cover file", fname);
+		}
+
+		std::lock_guard<std::mutex> lock(files_mutex);
+
+		if (files.count(fname) != 0)
+		{
+			UnlinkFile(fname);
+		}
+
+		OSLFile *oslfile = new OSLFile(fname);
+		oslfile->uuididx = uuididx++;
+		oslfile->size = size;
+		oslfile->synced_size = size;
+		oslfile->modification_time = NowSeconds();
+		oslfile->lbas.assign(lbas, lbas + nlbas);
+		oslfile->page_crcs.assign(crcs, crcs + nlbas);
+		files[fname] = oslfile;
+		LogName(oslfile, fname);
+		LogExtent(oslfile, 0);
+
+		return Status::OK();
+	}
+
+	Status OSLEnv::AllocateLBA(uint32_t *lba)
+	{
+		std::vector<uint32_t> lbas;
+
+		Status s = AllocateLBAs(1, &lbas);
+		if (s.ok())
+		{
+			*lba = lbas[0];
+		}
+		return s;
+	}
+
+	std::uint64_t OSLEnv::GetFreeBytes()
+	{
+		std::uint64_t free = (std::uint64_t)device->FreeLBACount() * OSL_ALIGMENT;
+
+		if (env_options.quota_bytes != 0)
+		{
+			std::uint64_t used = GetUsedBytes();
+			free = std::min<std::uint64_t>(free, env_options.quota_bytes > used ?
+					env_options.quota_bytes - used : 0);
+		}
+		return free;
+	}
+
+	Status OSLEnv::AllocateLBAs(size_t count, std::vector<uint32_t> *lbas,
+			std::uint32_t run)
+	{
+		std::int64_t pages = (std::int64_t)(count * run);
+		std::int64_t quota = (std::int64_t)(env_options.quota_bytes / OSL_ALIGMENT);
+
+		if (used_pages.fetch_add(pages) + pages > quota && quota != 0)
+		{
+			used_pages -= pages;
+			return Status::NoSpace("OSL env quota exceeded", dev_name);
+		}
+
+		Status s = device->AllocateLBAs(count, lbas, run);
+		if (!s.ok())
+		{
+			used_pages -= pages;
+		}
+		return s;
+	}
+
+	void OSLEnv::FreeLBAs(const std::vector<uint32_t> &lbas, std::uint32_t run)
+	{
+		device->FreeLBAs(lbas, run);
+		used_pages -= (std::int64_t)(lbas.size() * run);
+	}
+
+	void OSLEnv::ReturnLBAs(bool saved)
+	{
+		std::lock_guard<std::mutex> files_lock(files_mutex);
+		std::lock_guard<std::mutex> pack_lock(pack_mutex);
+		std::set<OSLFile *> seen;
+		std::vector<uint32_t> lbas;
+
+		for (auto it = files.begin(); it != files.end(); it++)
+		{
+			OSLFile *oslfile = it->second;
+			if (oslfile == NULL || oslfile->packed || !seen.insert(oslfile).second)
+			{
+				continue;
+			}
+			for (uint32_t first : oslfile->lbas)
+			{
+				for (std::uint32_t i = 0; i < oslfile->block_pages; i++)
+				{
+					lbas.push_back(first + i);
+				}
+			}
+			oslfile->lbas.clear();
+		}
+
+		for (auto it = pack_segments.begin(); it != pack_segments.end(); it++)
+		{
+			lbas.insert(lbas.end(), it->second.lbas.begin(), it->second.lbas.end());
+			it->second.lbas.clear();
+		}
+
+		if (saved)
+		{
+			device->ReserveLBAs(env_options.tenant, lbas);
+		}
+		else
+		{
+			FreeLBAs(lbas);
+		}
+	}
+
+	static bool IsBlockSize(size_t block_size)
+	{
+		return block_size >= OSL_ALIGMENT && block_size <= OSL_MAX_BLOCK &&
+			(block_size & (block_size - 1)) == 0;
+	}
+
+	/* WALs are synced a few bytes at a time and rewrite their last block on
+	 * every sync, so they want small blocks; SSTs are written once. */
+	std::uint32_t OSLEnv::BlockPagesFor(const std::string &fname) const
+	{
+		const std::string wal_suffix = ".log";
+		const std::string sst_suffix = ".sst";
+		size_t block_size = OSL_ALIGMENT;
+
+		if (fname.size() >= wal_suffix.size() &&
+				fname.compare(fname.size() - wal_suffix.size(), wal_suffix.size(),
+					wal_suffix) == 0)
+		{
+			block_size = env_options.wal_block_size;
+		}
+		else if (fname.size() >= sst_suffix.size() &&
+				fname.compare(fname.size() - sst_suffix.size(), sst_suffix.size(),
+					sst_suffix) == 0)
+		{
+			block_size = env_options.sst_block_size;
+		}
+
+		return block_size / OSL_ALIGMENT;
+	}
+
 	void OSLEnv::PrintMetaData()
 	{
 		std::map<std::string, OSLFile *>::iterator iter;
@@ -175,7 +529,56 @@ namespace rocksdb
 
 	Status NewOSLEnv(Env **osl_env, const std::string &dev_name)
 	{
-		OSLEnv *oslEnv = new OSLEnv(dev_name);
+		return NewOSLEnv(osl_env, dev_name, OSLEnvOptions());
+	}
+
+	Status NewOSLEnv(Env **osl_env, const std::string &dev_name,
+			const OSLEnvOptions &options)
+	{
+		if (!IsBlockSize(options.wal_block_size) ||
+				!IsBlockSize(options.sst_block_size))
+		{
+			return Status::InvalidArgument("OSL block sizes must be powers of two "
+					"from 4 KB to 1 MB");
+		}
+
+		if (options.tenant_weight == 0)
+		{
+			return Status::InvalidArgument("OSL tenant_weight must be positive");
+		}
+
+		std::shared_ptr<OSLDevice> device;
+		if (!options.tenant.empty())
+		{
+			Status s = OSLDevice::Attach(dev_name, options, &device);
+			if (!s.ok())
+			{
+				return s;
+			}
+		}
+
+		OSLEnv *oslEnv = new OSLEnv(dev_name, options, device);
+
+		if (!options.namespace_path.empty())
+		{
+			Status s = oslEnv->LoadNamespace();
+			/* Checkpoints what was replayed and opens the log. */
+			if (s.ok() || s.IsNotFound())
+			{
+				s = oslEnv->SaveNamespace();
+			}
+			if (!s.ok())
+			{
+				delete oslEnv;
+				return s;
+			}
+		}
+
+		if (!options.warmup_profile_path.empty())
+		{
+			oslEnv->Warmup();
+		}
+
 		*osl_env = oslEnv;
 		return Status::OK();
 	}
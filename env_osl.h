@@ -1,22 +1,45 @@
+#pragma once
+
 #include <errno.h>
 #include <pthread.h>
 #include <signal.h>
 #include <unistd.h>
 
+#include <algorithm>
 #include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
 #include <iostream>
 #include <map>
 #include <memory>
+#include <mutex>
 #include <string>
+#include <thread>
 #include <vector>
 #include <queue>
+#include <shared_mutex>
 
+#include "rocksdb/cache.h"
 #include "rocksdb/env.h"
 #include "rocksdb/statistics.h"
 #include "rocksdb/utilities/object_registry.h"
 
 #define OSL_ALIGMENT 4096
 #define OSL_MAX_BUF (OSL_ALIGMENT * 65536)
+#define OSL_HUGE_PAGE (2 * 1024 * 1024)
+#define OSL_BOUNCE_BUF OSL_HUGE_PAGE
+#define OSL_SCHED_CHUNK (OSL_ALIGMENT * 64)
+#define OSL_HEAT_REGION (OSL_ALIGMENT * 16)
+#define OSL_PACK_SEGMENT (OSL_ALIGMENT * 256)
+#define OSL_DEFAULT_DEVICE_LBAS 100
+#define OSL_READAHEAD_MIN OSL_SCHED_CHUNK
+#define OSL_READAHEAD_MAX (OSL_SCHED_CHUNK * 16)
+#define OSL_MAX_BLOCK (1024 * 1024)
+#define OSL_POOL_CACHED 256
+#define OSL_UNSYNCED ((std::uint64_t)-1)
+#define OSL_NAMESPACE_LOG_MIN (4 * 1024 * 1024)
 
 #define GET_NANOSECONDS(ns, ts)                       \
 	do                                                  \
@@ -26,11 +49,18 @@
 } while (0)
 
 #define MAX_KV_KEY_SIZE		16
+#define MAX_KV_VALUE_SIZE	OSL_ALIGMENT
+#define MAX_KV_BATCH		128
+#define MAX_OBJECT_NAME		256
 #define __NR_csd_syscall	294
 
 enum opcode{
+	READ = 'a',
+	WRITE = 'b',
 	GETOBJECT = 'c',
-	PUTOBJECT = 'd'
+	PUTOBJECT = 'd',
+	DELETEOBJECT = 'e',
+	COMPACTOBJECT = 'f'
 };
 
 
@@ -38,6 +68,8 @@ struct buff{
 	char command[4];
 };
 
+/* READ/WRITE: ObjectID holds how many consecutive LBAs, starting at lba,
+ * the command covers (0 means 1), and data_pointer that many pages. */
 struct csd_params {
 
 	int ObjectID;
@@ -46,11 +78,436 @@ struct csd_params {
 	struct buff buffer1;
 };
 
+/* Object commands travel in a csd_params envelope: data_pointer points at
+ * an array of csd_kv_object and ObjectID holds how many there are. */
+struct csd_kv_object {
+
+	char key[MAX_KV_KEY_SIZE];
+	unsigned int key_len;
+	unsigned int value_len;	/* GETOBJECT: buffer size in, value size out */
+	char* value;
+	int status;		/* per-object result, 0 or -errno */
+};
+
+/* A file as the device sees it: its pages are lbas[first .. first + nlbas)
+ * of the array the extent list comes with. */
+struct csd_extent {
+
+	unsigned long long uuididx;
+	unsigned long long size;
+	unsigned int first;
+	unsigned int nlbas;
+	char name[MAX_OBJECT_NAME];
+};
+
+/* COMPACTOBJECT: data_pointer points at one job. The device merges the
+ * inputs, writes the outputs into pages taken from lba_pool, and returns
+ * the serialized CompactionServiceResult. */
+struct csd_compaction_job {
+
+	unsigned long long job_id;
+	const char* db_path;
+	const char* output_path;	/* outputs are named relative to it */
+	const char* input;		/* serialized CompactionServiceInput */
+	unsigned int input_len;
+
+	struct csd_extent* inputs;
+	unsigned int ninputs;
+	const unsigned int* input_lbas;
+	const unsigned int* input_crcs;
+
+	const unsigned int* lba_pool;
+	unsigned int pool_size;
+
+	struct csd_extent* outputs;	/* out */
+	unsigned int max_outputs;
+	unsigned int noutputs;
+	unsigned int* output_lbas;	/* out, pool_size entries */
+	unsigned int* output_crcs;	/* out, pool_size entries */
+
+	char* result;			/* out */
+	unsigned int result_cap;
+	unsigned int result_len;
+};
+
 namespace rocksdb
 {
 
 	/* ### OSL Environment ### */
 
+	class OSLKVWriteBatch;
+
+	/* Carries csd_params commands to the device. The default goes through
+	 * the CSD system call; a user-space stand-in can take its place. */
+	class OSLTransport
+	{
+		public:
+			virtual ~OSLTransport()
+			{
+			}
+
+			/* Returns 0 on success, like the system call. */
+			virtual long Submit(struct csd_params *parameters) = 0;
+
+			/* Bytes of LBA space behind the transport (0 = unknown). */
+			virtual std::uint64_t CapacityBytes()
+			{
+				return 0;
+			}
+	};
+
+	/* Final, so that page engines instantiated for it call Submit directly
+	 * and inline it down to the system call. */
+	class OSLSyscallTransport final : public OSLTransport
+	{
+		public:
+			long Submit(struct csd_params *parameters) override
+			{
+				return syscall(__NR_csd_syscall, (void *)parameters);
+			}
+	};
+
+	struct OSLEnvOptions
+	{
+		/* Place I/O buffers on the device's NUMA node (-1 = detect from sysfs). */
+		bool numa_aware = true;
+		int numa_node = -1;
+
+		/* Back write caches and read bounce buffers with 2 MB huge pages,
+		 * falling back to transparent huge pages when none are reserved. */
+		bool use_huge_pages = true;
+
+		/* Device commands allowed in flight at once. */
+		int queue_depth = 32;
+
+		/* Device submission queues, each served by one pinned worker thread.
+		 * Reads and syncs larger than OSL_SCHED_CHUNK are split into chunks
+		 * spread over them (0 or 1 = submit on the calling thread). */
+		int submit_queues = 4;
+
+		/* Files no larger than this when synced are appended to a shared
+		 * pack segment instead of getting LBAs of their own (0 = never;
+		 * capped at the pack segment size). WALs, synced piecemeal, are not. */
+		size_t pack_threshold = 64 * 1024;
+
+		/* Token bucket for flush and compaction writes (0 = unlimited). */
+		std::uint64_t bg_write_bytes_per_sec = 0;
+
+		/* Device transport; NULL selects the CSD system call. */
+		std::shared_ptr<OSLTransport> transport;
+
+		/* Bytes of LBA space on the device (0 = ask the transport, or
+		 * OSL_DEFAULT_DEVICE_LBAS pages if it cannot tell). */
+		std::uint64_t device_bytes = 0;
+
+		/* Posix file holding the namespace snapshot (empty = not persisted).
+		 * Loaded by NewOSLEnv; changes go to <namespace_path>.<n>.log as
+		 * files sync, and directory fsync checkpoints the log into the
+		 * snapshot once it grows past it. */
+		std::string namespace_path;
+
+		/* Env-level LRU cache of verified pages, filled by Prefetch and by
+		 * warmup (0 = disabled). */
+		size_t page_cache_bytes = 0;
+
+		/* Posix file recording the most read OSL_HEAT_REGION ranges. It is
+		 * written when the env is destroyed and replayed into the page cache
+		 * by NewOSLEnv, warmup_bytes at most, on warmup_threads threads. */
+		std::string warmup_profile_path;
+		size_t warmup_bytes = 256 * 1024 * 1024;
+		int warmup_threads = 8;
+
+		/* Logical block size of new WALs and SSTs: a power of two multiple
+		 * of OSL_ALIGMENT, up to OSL_MAX_BLOCK. A block is a run of that many
+		 * contiguous, aligned LBAs, written and read with one command and
+		 * covered by one CRC. Other files always use OSL_ALIGMENT. */
+		size_t wal_block_size = OSL_ALIGMENT;
+		size_t sst_block_size = OSL_ALIGMENT;
+
+		/* Posix directory on fast local storage holding copies of the hottest
+		 * SSTs, up to tier_capacity bytes (empty = no tiering). The env owns
+		 * it; copies left from an earlier run are removed at startup. */
+		std::string tier_path;
+		std::uint64_t tier_capacity = 4ull * 1024 * 1024 * 1024;
+
+		/* Seconds between migrator passes. Each pass halves every file's
+		 * temperature; a file is promoted once its temperature, weighted by
+		 * its lifetime hint, reaches tier_promote_score, and demoted once it
+		 * falls below a quarter of that. */
+		int tier_interval_sec = 10;
+		std::uint32_t tier_promote_score = 256;
+
+		/* Shares dev_name with the other envs of the process that name a
+		 * tenant: they draw from one LBA allocator and one I/O scheduler,
+		 * whose slots are split between tenants in proportion to
+		 * tenant_weight. Each tenant keeps its own files, namespace_path and
+		 * tier_path, which must not be shared. The device is set up with the
+		 * transport and queue_depth of the first tenant (empty = the env has
+		 * dev_name to itself). */
+		std::string tenant;
+		std::uint32_t tenant_weight = 1;
+
+		/* Device bytes the env's files may occupy; allocations beyond it fail
+		 * with NoSpace (0 = unlimited). */
+		std::uint64_t quota_bytes = 0;
+	};
+
+	/* I/O classes in dispatch priority order. */
+	enum OSLIOClass
+	{
+		OSL_IO_WAL = 0,
+		OSL_IO_USER_READ,
+		OSL_IO_FLUSH,
+		OSL_IO_COMPACTION,
+		OSL_IO_CLASSES
+	};
+
+	/* Admission control in front of the device, shared by its tenants.
+	 * Callers take a slot before submitting up to OSL_SCHED_CHUNK bytes and
+	 * give it back afterwards. A free slot goes to the highest-priority
+	 * class with a waiter; within it, to the tenant that has been granted
+	 * the fewest bytes for its weight, and to that tenant's oldest waiter.
+	 * Flush/compaction writes additionally draw from their tenant's token
+	 * bucket. Implemented at env_osl_sched.cc. */
+	class OSLIOScheduler
+	{
+		public:
+			explicit OSLIOScheduler(int queue_depth);
+
+			/* Returns the id the tenant passes to Acquire. */
+			int AddTenant(std::uint32_t weight, std::uint64_t bg_write_bytes_per_sec);
+
+			/* Called once the tenant has no I/O left. */
+			void RemoveTenant(int tenant);
+
+			void Acquire(int tenant, OSLIOClass io_class, size_t bytes, bool is_write);
+
+			void Release();
+
+			void SetBackgroundWriteRate(int tenant, std::uint64_t bytes_per_sec);
+
+			/* Class of I/O issued by the calling thread, derived from the
+			 * thread pool that is running it. */
+			static OSLIOClass ThreadReadClass();
+			static OSLIOClass ThreadWriteClass();
+			static void SetThreadPool(int pri);
+
+		private:
+			struct Tenant
+			{
+				std::uint32_t weight;
+
+				/* Bytes granted over weight: the tenant's virtual time. */
+				double vtime;
+
+				std::uint64_t rate;
+				double tokens;
+				std::uint64_t last_refill_us;
+			};
+
+			struct Waiter
+			{
+				Tenant *tenant;
+				OSLIOClass io_class;
+				size_t bytes;
+				bool throttled;
+			};
+
+			std::mutex mutex_;
+			std::condition_variable cv_;
+			std::deque<Waiter *> queues_[OSL_IO_CLASSES];
+			std::map<int, Tenant> tenants_;
+			int next_tenant_;
+			int queue_depth_;
+			int inflight_;
+
+			/* Virtual time of the last grant. A tenant coming back from idle
+			 * starts from here instead of spending the share it left unused. */
+			double vclock_;
+
+			const Waiter *NextGrant();
+			static bool Throttled(const Waiter *w);
+			static void RefillTokens(Tenant *tenant);
+			static std::uint64_t TokenWaitMicros(const Tenant *tenant);
+	};
+
+	/* Holds scheduler slots across a run of page commands, re-acquiring one
+	 * every OSL_SCHED_CHUNK bytes so long transfers yield to higher classes. */
+	class OSLIOGrant
+	{
+		public:
+			OSLIOGrant(OSLIOScheduler *sched, int tenant, OSLIOClass io_class,
+					bool is_write)
+				: sched_(sched), tenant_(tenant), io_class_(io_class),
+				is_write_(is_write), held_(false), pages_left_(0)
+			{
+			}
+
+			~OSLIOGrant()
+			{
+				if (held_)
+				{
+					sched_->Release();
+				}
+			}
+
+			/* Called before each device command; remaining is the number of
+			 * bytes the caller still has to transfer, and bytes the number
+			 * the command moves. A command larger than OSL_SCHED_CHUNK
+			 * takes a slot of its own. */
+			void Page(size_t remaining, size_t bytes = OSL_ALIGMENT)
+			{
+				if (pages_left_ == 0)
+				{
+					size_t chunk = std::max<size_t>(bytes, OSL_SCHED_CHUNK);
+					if (held_)
+					{
+						sched_->Release();
+					}
+					sched_->Acquire(tenant_, io_class_, std::min(remaining, chunk),
+							is_write_);
+					held_ = true;
+					pages_left_ = chunk / OSL_ALIGMENT;
+				}
+				pages_left_ -= std::min(pages_left_, bytes / OSL_ALIGMENT);
+			}
+
+		private:
+			OSLIOScheduler *sched_;
+			int tenant_;
+			OSLIOClass io_class_;
+			bool is_write_;
+			bool held_;
+			size_t pages_left_;
+	};
+
+	/* What the envs on one device share: the transport, the LBA allocator
+	 * and the I/O scheduler. Envs naming a tenant attach to the process-wide
+	 * OSLDevice of their dev_name, the others get one of their own.
+	 * Implemented at env_osl_device.cc. */
+	class OSLDevice
+	{
+		public:
+			OSLDevice(const std::string &dev_name, const OSLEnvOptions &opts);
+
+			/* Returns the shared device of dev_name, set up with opts by its
+			 * first tenant, and registers opts.tenant on it. */
+			static Status Attach(const std::string &dev_name,
+					const OSLEnvOptions &opts, std::shared_ptr<OSLDevice> *device);
+
+			void Detach(const std::string &tenant);
+
+			OSLTransport *GetTransport()
+			{
+				return transport_.get();
+			}
+
+			OSLIOScheduler *GetIOScheduler()
+			{
+				return &io_scheduler_;
+			}
+
+			/* LBAs the device was set up with, [0, CapacityLBAs()). */
+			std::uint32_t CapacityLBAs() const
+			{
+				return capacity_lbas_;
+			}
+
+			Status AllocateLBA(uint32_t *lba);
+
+			/* Appends the first LBA of count runs of run contiguous LBAs, each
+			 * aligned to run; all of them or none. */
+			Status AllocateLBAs(size_t count, std::vector<uint32_t> *lbas,
+					std::uint32_t run = 1);
+
+			void FreeLBAs(const std::vector<uint32_t> &lbas, std::uint32_t run = 1);
+
+			/* Free LBAs, not counting reservations. */
+			size_t FreeLBACount();
+
+			/* Takes the given single LBAs for tenant, all of them or none,
+			 * failing if one is neither free nor reserved for it. Used to
+			 * load a namespace snapshot; reserved LBAs the snapshot does not
+			 * use are freed. */
+			Status ClaimLBAs(const std::string &tenant, std::vector<uint32_t> lbas);
+
+			/* Keeps the given single LBAs for tenant until it claims them. */
+			void ReserveLBAs(const std::string &tenant,
+					const std::vector<uint32_t> &lbas);
+
+			/* Replaces the free list with lbas. */
+			void ResetFreeLBAs(const std::vector<uint32_t> &lbas);
+
+		private:
+			const std::string dev_name_;
+			std::shared_ptr<OSLTransport> transport_;
+			OSLIOScheduler io_scheduler_;
+			std::uint32_t capacity_lbas_;
+
+			/* Free LBAs as runs, first LBA -> length; adjacent runs merge. */
+			std::mutex lba_mutex_;
+			std::map<uint32_t, uint32_t> free_lbas_;
+
+			/* LBAs of closed tenants' saved namespaces, by tenant. */
+			std::map<std::string, std::vector<uint32_t>> reserved_lbas_;
+
+			std::mutex tenants_mutex_;
+			std::vector<std::string> tenants_;
+
+			/* Called with lba_mutex_ held. */
+			bool TakeFreeRun(std::uint32_t run, uint32_t *first);
+			void InsertFreeRun(uint32_t first, std::uint32_t len);
+			bool IsFreeRange(uint32_t first, std::uint32_t len);
+			void TakeRange(uint32_t first, std::uint32_t len);
+	};
+
+	class OSLEnv;
+
+	/* Worker pool in front of the device queues. Run() hands all but the
+	 * first chunk of a transfer to the workers, runs the first itself and
+	 * sleeps once until the last chunk completes. Implemented at
+	 * env_osl_queue.cc. */
+	struct OSLBounceSet;
+
+	class OSLSubmitQueues
+	{
+		public:
+			OSLSubmitQueues(OSLEnv *env, int nqueues);
+
+			~OSLSubmitQueues();
+
+			/* Returns the first failure among the chunks. Each worker runs
+			 * its queued chunks highest class first, so a read is not held
+			 * behind throttled compaction writes. */
+			Status Run(const std::vector<std::function<Status()>> &chunks,
+					OSLIOClass io_class);
+
+		private:
+			struct Request;
+
+			struct Task
+			{
+				Request *request;
+				const std::function<Status()> *chunk;
+			};
+
+			struct Queue
+			{
+				std::mutex mutex;
+				std::condition_variable cv;
+				std::deque<Task> tasks[OSL_IO_CLASSES];
+				size_t ntasks = 0;
+				std::thread worker;
+			};
+
+			OSLEnv *env_;
+			std::vector<std::unique_ptr<Queue>> queues_;
+			std::atomic<unsigned int> next_queue_;
+			std::atomic<bool> shutdown_;
+
+			void WorkerLoop(Queue *queue);
+	};
+
 	class OSLFile
 	{
 		public:
@@ -59,13 +516,59 @@ namespace rocksdb
 			size_t before_truncate_size;
 			std::uint64_t uuididx;
 			std::uint32_t startIndex;
+			/* First LBA of each block; a block is block_pages contiguous LBAs. */
 			std::vector<uint32_t> lbas;
+			std::uint32_t block_pages;
+
+			/* CRC32C of the valid bytes of each block in lbas, and the number
+			 * of bytes that have reached the device. */
+			std::vector<uint32_t> page_crcs;
+			size_t synced_size;
+
+			/* Names in OSLEnv::files sharing this file. Each name, open handle
+			 * and migration in progress holds a reference; the file and its
+			 * extents are freed with the last one (OSLEnv::UnrefFile). */
+			std::uint32_t links;
+			std::atomic<std::uint32_t> refs;
+
+			/* Seconds since the epoch of the last Sync. */
+			std::uint64_t modification_time;
+
+			/* A packed file has no lbas of its own; its synced bytes are
+			 * [pack_offset, pack_offset + pack_length) of a pack segment,
+			 * covered as a whole by pack_crc. */
+			bool packed;
+			std::uint32_t pack_segment;
+			std::uint64_t pack_offset;
+			std::uint32_t pack_length;
+			std::uint32_t pack_crc;
+
+			/* User reads per OSL_HEAT_REGION, feeding the warmup profile, and
+			 * user reads since the last migrator pass, halved by each pass. */
+			std::mutex heat_mutex;
+			std::vector<uint32_t> heat;
+			std::uint32_t temperature;
+
+			/* Lifetime hint of the writer less Env::WLTH_SHORT (-1 = none). */
+			int level;
+
+			/* While promoted, reads are served from a copy of the synced bytes
+			 * at local_path; the device pages stay as they are. tier_mutex is
+			 * held shared by reads and exclusively while the migrator installs
+			 * or drops the copy. */
+			std::unique_ptr<RandomAccessFile> local;
+			std::string local_path;
+			mutable std::shared_mutex tier_mutex;
 
 			OSLFile(const std::string &fname)
-				: name(fname), uuididx(0)
+				: name(fname), uuididx(0), links(1), refs(1), modification_time(0),
+				packed(false), pack_segment(0), pack_offset(0), pack_length(0),
+				pack_crc(0), temperature(0), level(-1)
 			{
+				block_pages = 1;
 				before_truncate_size = 0;
 				size = 0;
+				synced_size = 0;
 				startIndex = 0;
 			}
 
@@ -73,38 +576,418 @@ namespace rocksdb
 			{
 			}
 
+			size_t BlockSize() const
+			{
+				return (size_t)block_pages * OSL_ALIGMENT;
+			}
+
+			/* Only taken from a reference already held, or a name under
+			 * OSLEnv::files_mutex. */
+			void Ref()
+			{
+				refs.fetch_add(1, std::memory_order_relaxed);
+			}
+
 			void PrintMetaData();
+
+			void RecordRead(uint64_t offset, size_t n);
+	};
+
+	/* One synced block of a file as a reader saw it under files_mutex:
+	 * its first LBA, its CRC and how many of its bytes the CRC covers. */
+	struct OSLBlockRef
+	{
+		uint32_t lba;
+		uint32_t crc;
+		size_t valid;
+	};
+
+	/* Page read and write loops of one transport type, specialized at
+	 * compile time on it and on 4 KB blocks: one pair for single page
+	 * blocks, one for any block size. OSLEnv selects the engine matching its
+	 * transport once, at construction. Implemented at env_osl_io.cc. */
+	struct OSLIOEngine
+	{
+		/* Reads [offset, offset + n) of oslfile into scratch, verified. */
+		typedef Status (*ReadFn)(OSLEnv *env, const OSLFile *oslfile,
+				uint64_t offset, size_t n, char *scratch, OSLIOClass io_class);
+
+		/* Writes blocks [first, first + nblocks) of oslfile from buf. */
+		typedef Status (*WriteFn)(OSLEnv *env, const OSLFile *oslfile,
+				size_t first, size_t nblocks, const char *buf, OSLIOClass io_class);
+
+		ReadFn read_pages;
+		WriteFn write_pages;
+		ReadFn read_blocks;
+		WriteFn write_blocks;
+
+		ReadFn Read(const OSLFile *oslfile) const
+		{
+			return oslfile->block_pages == 1 ? read_pages : read_blocks;
+		}
+
+		WriteFn Write(const OSLFile *oslfile) const
+		{
+			return oslfile->block_pages == 1 ? write_pages : write_blocks;
+		}
+
+		static const OSLIOEngine *Select(OSLTransport *transport);
+	};
+
+	/* Up to OSL_PACK_SEGMENT bytes of LBAs shared by small files. Only the
+	 * active segment is appended to; a sealed one is freed once no live
+	 * bytes are left, and moved out of by CollectPackSegments when mostly
+	 * dead. */
+	struct OSLPackSegment
+	{
+		std::vector<uint32_t> lbas;
+		size_t fill;
+		size_t live;
+		bool sealed;
+
+		/* Reads in flight; a dead segment is freed when the last one ends. */
+		int readers = 0;
 	};
 
 	class OSLEnv : public Env
 	{
 		public:
 			std::map<std::string, OSLFile *> files;
-			std::priority_queue<uint32_t> free_lbas;
+
+			/* Guards files and the metadata of every OSLFile in it. */
+			std::mutex files_mutex;
+
 			uint64_t sequence;
 
 			std::uint64_t uuididx;
 
-			explicit OSLEnv(const std::string &dname) : dev_name(dname)
+			/* Runs on shared, or on a device of its own if that is NULL. */
+			explicit OSLEnv(const std::string &dname,
+					const OSLEnvOptions &opts = OSLEnvOptions(),
+					std::shared_ptr<OSLDevice> shared = nullptr)
+				: dev_name(dname), env_options(opts),
+				device(shared ? shared : std::make_shared<OSLDevice>(dname, opts))
 			{
 				posixEnv = Env::Default();
+				io_tenant = device->GetIOScheduler()->AddTenant(
+						opts.tenant_weight, opts.bg_write_bytes_per_sec);
+				io_engine = OSLIOEngine::Select(device->GetTransport());
+				used_pages = 0;
 				uuididx = 0;
 				sequence = 0;
-				for(int i=0; i<100; i++) {
-					free_lbas.push(i);
+				persist_namespace = !opts.namespace_path.empty();
+				active_segment = 0;
+				next_segment = 1;
+				pack_buffer = NULL;
+				pack_gc_pending = false;
+				pack_tickets = 0;
+				pack_turn = 0;
+				pack_segment_bytes = std::min<size_t>(OSL_PACK_SEGMENT,
+						(size_t)(device->CapacityLBAs() / 4) * OSL_ALIGMENT);
+				env_id = NewEnvId();
+				log_gen = 0;
+				snapshot_gen = 0;
+				log_bytes = 0;
+				snapshot_bytes = 0;
+				if (opts.page_cache_bytes)
+				{
+					page_cache = NewLRUCache(opts.page_cache_bytes);
+				}
+				if (opts.submit_queues > 1)
+				{
+					submit_queues.reset(new OSLSubmitQueues(this, opts.submit_queues));
+				}
+				InitNumaNode();
+				tier_bytes = 0;
+				tier_shutdown = false;
+				readahead_shutdown = false;
+				if (!opts.tier_path.empty())
+				{
+					StartTiering();
 				}
 				std::cout << "Initializing OSL Environment" << std::endl;
 			}
 
 			virtual ~OSLEnv()
 			{
+				StopTiering();
+				StopReadahead();
+				SaveWarmupProfile();
+				bool saved = persist_namespace && SaveNamespace().ok();
+				submit_queues.reset();
+				if (pack_buffer)
+				{
+					FreeIOBuffer(pack_buffer, OSL_PACK_SEGMENT);
+				}
+				ReleaseBounceBuffers();
+				device->GetIOScheduler()->RemoveTenant(io_tenant);
+				if (!env_options.tenant.empty())
+				{
+					ReturnLBAs(saved);
+					device->Detach(env_options.tenant);
+				}
 				std::cout << "Destroying OSL Environment" << std::endl;
 			}
 
 			void PrintMetaData();
 
+			/* ### NUMA placement, implemented at env_osl_mem.cc ### */
+
+			int GetNumaNode() const
+			{
+				return numa_node;
+			}
+
+			char *AllocIOBuffer(size_t size);
+
+			void FreeIOBuffer(char *buf, size_t size);
+
+			/* Per-thread OSL_BOUNCE_BUF sized buffer on the device's node,
+			 * freed when the thread exits or the env is destroyed. */
+			char *BounceBuffer();
+
+			/* Binds the calling thread to the CPUs of the device's node. Every
+			 * thread owned by the env calls this before issuing I/O. */
+			Status PinThreadToDevice();
+
+			/* ### Device access, implemented at env_osl_io.cc ### */
+
+			/* Moves npages pages between buf and the LBAs from lba on. */
+			Status SubmitLBA(char command, uint32_t lba, char *buf,
+					uint32_t npages = 1);
+
+			OSLTransport *GetTransport()
+			{
+				return device->GetTransport();
+			}
+
+			OSLDevice *GetDevice()
+			{
+				return device.get();
+			}
+
+			const OSLIOEngine *GetIOEngine() const
+			{
+				return io_engine;
+			}
+
+			/* Copies blocks [first, end) of oslfile under files_mutex, fewer
+			 * if its synced blocks end sooner. Readers work from the copy:
+			 * Sync may reallocate lbas and page_crcs meanwhile. Implemented
+			 * at env_osl_io.cc. */
+			void SnapshotBlocks(const OSLFile *oslfile, size_t first, size_t end,
+					std::vector<OSLBlockRef> *blocks);
+
+			Status ReadLBA(uint32_t lba, char *buf, uint32_t npages = 1)
+			{
+				return SubmitLBA(READ, lba, buf, npages);
+			}
+
+			Status WriteLBA(uint32_t lba, char *buf, uint32_t npages = 1)
+			{
+				return SubmitLBA(WRITE, lba, buf, npages);
+			}
+
+			/* Calls transfer(off, len) over [offset, offset + n) cut at
+			 * multiples of chunk, in parallel on the submission queues at
+			 * io_class priority. Implemented at env_osl_queue.cc. */
+			Status SubmitChunked(uint64_t offset, size_t n, OSLIOClass io_class,
+					const std::function<Status(uint64_t, size_t)> &transfer,
+					size_t chunk = OSL_SCHED_CHUNK);
+
+			/* Runs fetch on the env's readahead thread, started on first use,
+			 * and returns its status through the future. Implemented at
+			 * env_osl_queue.cc. */
+			std::future<Status> SubmitReadahead(std::function<Status()> fetch);
+
+			/* Adds a file whose pages were written by the device itself, e.g.
+			 * a compaction output. */
+			Status RegisterFile(const std::string &fname, std::uint64_t size,
+					const uint32_t *lbas, const uint32_t *crcs, size_t nlbas);
+
+			/* ### Namespace snapshot, implemented at env_osl_namespace.cc ###
+			 *
+			 * The namespace is the only record of which LBAs hold which file.
+			 * Both use OSLEnvOptions::namespace_path; NotFound from Load means
+			 * there is no snapshot yet. Every change made after a snapshot is
+			 * appended to the metadata log that goes with it, so the snapshot
+			 * is only a checkpoint: SaveNamespace writes a new one and starts
+			 * the next log. */
+
+			Status SaveNamespace();
+
+			Status LoadNamespace();
+
+			/* Log records, appended under files_mutex (LogSegment under
+			 * pack_mutex) so the log keeps the order of the changes. Only
+			 * synced state is logged, as in the snapshot. */
+			void LogName(const OSLFile *oslfile, const std::string &name);
+			void LogUnname(const std::string &name);
+			void LogExtent(const OSLFile *oslfile, size_t first_block);
+			void LogPacked(const OSLFile *oslfile);
+			void LogSegment(std::uint32_t id, const OSLPackSegment &seg);
+
+			/* Makes every record appended so far durable; called by file Sync
+			 * once the extent is published. */
+			Status SyncLog();
+
+			/* Directory fsync: syncs the log, and checkpoints once the log
+			 * has outgrown the snapshot. */
+			Status SyncNamespace();
+
+			/* Identifies this namespace in file unique IDs; it is kept in the
+			 * namespace snapshot, so IDs are stable across restarts. */
+			std::uint64_t GetEnvId() const
+			{
+				return env_id;
+			}
+
+			/* ### Page cache and warmup, implemented at env_osl_warmup.cc ###
+			 *
+			 * Only blocks lying wholly below synced_size are cached; they are
+			 * never rewritten, so a cached block stays valid until its file is
+			 * deleted or truncated below it. Blocks are keyed by uuididx and
+			 * block index. */
+
+			bool HasPageCache() const
+			{
+				return page_cache != nullptr;
+			}
+
+			/* Returns NULL on a miss; a hit is released with ReleasePage. */
+			Cache::Handle *LookupPage(const OSLFile *oslfile, size_t idx);
+
+			const char *PageData(Cache::Handle *handle)
+			{
+				return (const char *)page_cache->Value(handle);
+			}
+
+			void ReleasePage(Cache::Handle *handle)
+			{
+				page_cache->Release(handle);
+			}
+
+			void ErasePages(const OSLFile *oslfile, size_t first_idx);
+
+			/* Reads [offset, offset + n) of oslfile into the page cache. */
+			Status PrefetchPages(const OSLFile *oslfile, uint64_t offset, size_t n);
+
+			Status SaveWarmupProfile();
+
+			/* Prefetches the regions of the warmup profile in parallel. Run
+			 * before the DB is opened, while no file can be deleted. */
+			Status Warmup();
+
+			/* ### Small-file packing, implemented at env_osl_pack.cc ### */
+
+			size_t PackThreshold() const
+			{
+				return std::min<size_t>(env_options.pack_threshold, pack_segment_bytes);
+			}
+
+			/* Appends data to the active segment and writes it through. The
+			 * range is reserved under pack_mutex and written without it, in
+			 * reservation order, since neighbouring extents share a page. */
+			Status PackBytes(const char *data, size_t n, OSLIOClass io_class,
+					std::uint32_t *segment, std::uint64_t *offset);
+
+			/* Marks length bytes of segment dead. */
+			void ReleasePacked(std::uint32_t segment, size_t length);
+
+			/* Reads [offset, offset + n) of a packed file. TryAgain means the
+			 * file is no longer packed. */
+			Status ReadPacked(const OSLFile *oslfile, uint64_t offset, size_t n,
+					char *scratch);
+
+			/* Moves the live files out of mostly dead sealed segments. */
+			Status CollectPackSegments();
+
+			/* ### Tiering, implemented at env_osl_tier.cc ###
+			 *
+			 * Every file stays on the device. A migrator thread copies hot
+			 * finished SSTs to OSLEnvOptions::tier_path and serves their reads
+			 * from there until they cool down. */
+
+			/* One migrator pass: demotes the files that cooled down, then
+			 * promotes the hottest candidates that fit. */
+			Status MigrateTiers();
+
+			/* Reads [offset, offset + n) of oslfile through the same path as
+			 * its readers. Implemented at env_osl_io.cc. */
+			Status ReadFileRange(const OSLFile *oslfile, uint64_t offset, size_t n,
+					char *scratch);
+
+			/* ### LBA allocator, implemented at env_osl.cc ###
+			 *
+			 * Allocations come from the device, charged against quota_bytes. */
+
+			Status AllocateLBA(uint32_t *lba);
+
+			/* Appends the first LBA of count runs of run contiguous LBAs, each
+			 * aligned to run; all of them or none. */
+			Status AllocateLBAs(size_t count, std::vector<uint32_t> *lbas,
+					std::uint32_t run = 1);
+
+			void FreeLBAs(const std::vector<uint32_t> &lbas, std::uint32_t run = 1);
+
+			/* Bytes of device pages the env's files hold. */
+			std::uint64_t GetUsedBytes() const
+			{
+				return (std::uint64_t)std::max<std::int64_t>(used_pages, 0) *
+					OSL_ALIGMENT;
+			}
+
+			/* Bytes the env can still allocate: the free device pages, capped
+			 * by what is left of quota_bytes. */
+			std::uint64_t GetFreeBytes();
+
+			/* Pages per block of a new file named fname. */
+			std::uint32_t BlockPagesFor(const std::string &fname) const;
+
+			/* ### Native key-value passthrough, implemented at env_osl_kv.cc ###
+			 *
+			 * Keys of at most MAX_KV_KEY_SIZE bytes and values of at most
+			 * MAX_KV_VALUE_SIZE bytes go straight to the device's object
+			 * interface, bypassing the LSM. There is no ordering or iteration;
+			 * this namespace is separate from the files RocksDB stores.
+			 * Objects are not scoped by tenant, so envs that name one get
+			 * NotSupported instead of sharing keys with the other tenants. */
+
+			Status KVPut(const Slice &key, const Slice &value);
+
+			Status KVGet(const Slice &key, std::string *value);
+
+			Status KVDelete(const Slice &key);
+
+			std::vector<Status> KVMultiGet(const std::vector<Slice> &keys,
+					std::vector<std::string> *values);
+
+			Status KVWrite(const OSLKVWriteBatch &batch);
+
+			Status SubmitKV(char command, struct csd_kv_object *objects, int count);
+
+			OSLIOScheduler *GetIOScheduler()
+			{
+				return device->GetIOScheduler();
+			}
+
+			/* Identifies the env's I/O to the device scheduler. */
+			int GetIOTenant() const
+			{
+				return io_tenant;
+			}
+
+			void SetBackgroundWriteRateLimit(std::uint64_t bytes_per_sec)
+			{
+				device->GetIOScheduler()->SetBackgroundWriteRate(io_tenant, bytes_per_sec);
+			}
+
 			/* ### Implemented at env_osl.cc ### */
 
+			/* Drops a reference taken with OSLFile::Ref, freeing the file with
+			 * the last one. Called without files_mutex held. */
+			void UnrefFile(OSLFile *oslfile);
+
 			Status NewSequentialFile(const std::string &fname,
 					std::unique_ptr<SequentialFile> *result,
 					const EnvOptions &options) override;
@@ -127,12 +1010,26 @@ namespace rocksdb
 			Status RenameFile(const std::string &src,
 					const std::string &target) override;
 
+			Status LinkFile(const std::string &src,
+					const std::string &target) override;
+
+			Status FileExists(const std::string &fname) override;
+
+			Status GetChildren(const std::string &path,
+					std::vector<std::string> *result) override;
+
+			/* Implemented at env_osl_namespace.cc: an fsync of a directory
+			 * also persists the namespace. */
+			Status NewDirectory(const std::string &name,
+					std::unique_ptr<Directory> *result) override;
+
 			/* ### Implemented here ### */
 
-			Status LinkFile(const std::string & /*src*/,
-					const std::string & /*target*/) override
+			std::uint64_t NowSeconds()
 			{
-				return Status::NotSupported(); // not supported
+				int64_t now = 0;
+				posixEnv->GetCurrentTime(&now);
+				return (std::uint64_t)now;
 			}
 
 			static std::uint64_t gettid()
@@ -147,23 +1044,6 @@ namespace rocksdb
 
 			/* ### Posix inherited functions ### */
 
-			Status NewDirectory(const std::string &name,
-					std::unique_ptr<Directory> *result) override
-			{
-				return posixEnv->NewDirectory(name, result);
-			}
-
-			Status FileExists(const std::string &fname) override
-			{
-				return posixEnv->FileExists(fname);
-			}
-
-			Status GetChildren(const std::string &path,
-					std::vector<std::string> *result) override
-			{
-				return posixEnv->GetChildren(path, result);
-			}
-
 			Status CreateDir(const std::string &name) override
 			{
 				return posixEnv->CreateDir(name);
@@ -200,12 +1080,11 @@ namespace rocksdb
 				return posixEnv->NewLogger(fname, result);
 			}
 
+			/* Implemented at env_osl_sched.cc: tags the job with its pool so
+			 * the I/O it issues is scheduled under the matching class. */
 			void Schedule(void (*function)(void *arg), void *arg, Priority pri = LOW,
 					void *tag = nullptr,
-					void (*unschedFunction)(void *arg) = 0) override
-			{
-				posixEnv->Schedule(function, arg, pri, tag, unschedFunction);
-			}
+					void (*unschedFunction)(void *arg) = 0) override;
 
 			int UnSchedule(void *tag, Priority pri) override
 			{
@@ -291,6 +1170,107 @@ namespace rocksdb
 		private:
 			Env *posixEnv;
 			const std::string dev_name;
+			const OSLEnvOptions env_options;
+			std::shared_ptr<OSLDevice> device;
+			int io_tenant;
+			const OSLIOEngine *io_engine;
+			std::unique_ptr<OSLSubmitQueues> submit_queues;
+
+			/* Pages allocated to the env's files. */
+			std::atomic<std::int64_t> used_pages;
+
+			bool persist_namespace;
+			std::mutex snapshot_mutex;
+			std::uint64_t env_id;
+
+			/* The metadata log; ns_log is replaced only by SaveNamespace. An
+			 * append error sticks until the next checkpoint. */
+			std::mutex log_mutex;
+			std::shared_ptr<WritableFile> ns_log;
+			Status ns_log_status;
+			std::uint64_t log_gen;
+			std::uint64_t snapshot_gen;
+			std::uint64_t log_bytes;
+			std::uint64_t snapshot_bytes;
+
+			std::string LogPath(std::uint64_t gen) const;
+			/* Called with log_mutex held. */
+			Status OpenLog(std::uint64_t gen);
+			void AppendLog(const std::string &record);
+
+			std::shared_ptr<Cache> page_cache;
+
+			std::mutex pack_mutex;
+			std::map<std::uint32_t, OSLPackSegment> pack_segments;
+			/* Turn of the next pack write; pack_tickets hands them out. */
+			std::condition_variable pack_cv;
+			std::uint64_t pack_tickets;
+			std::uint64_t pack_turn;
+			std::uint32_t active_segment;
+			std::uint32_t next_segment;
+			char *pack_buffer;
+			bool pack_gc_pending;
+			/* Bytes of a new segment: OSL_PACK_SEGMENT, or a quarter of a
+			 * smaller device (0 = too small to pack). */
+			size_t pack_segment_bytes;
+
+			/* Called with pack_mutex held. Copies the LBAs holding
+			 * [offset, offset + length) of segment and keeps the segment from
+			 * being freed until UnpinSegment. */
+			Status PinPackExtent(std::uint32_t segment, std::uint64_t offset,
+					size_t length, std::vector<uint32_t> *lbas);
+
+			void UnpinSegment(std::uint32_t segment);
+
+			Status ReadPackExtent(const std::vector<uint32_t> &lbas,
+					std::uint64_t offset, size_t length, std::uint32_t crc,
+					uint64_t sub_offset, size_t n, char *dst);
+
+			void FreeSegmentIfDead(std::uint32_t segment);
+
+			std::thread tier_thread;
+			std::mutex tier_wait_mutex;
+			std::condition_variable tier_cv;
+			bool tier_shutdown;
+
+			/* Bytes of copies in tier_path, guarded by files_mutex. */
+			std::uint64_t tier_bytes;
+
+			std::thread readahead_thread;
+			std::mutex readahead_mutex;
+			std::condition_variable readahead_cv;
+			std::deque<std::packaged_task<Status()>> readahead_tasks;
+			bool readahead_shutdown;
+
+			void ReadaheadLoop();
+			void StopReadahead();
+
+			void StartTiering();
+			void StopTiering();
+			void TierLoop();
+			Status PromoteFile(OSLFile *oslfile, std::uint64_t size);
+			void DemoteFile(OSLFile *oslfile);
+
+			static std::uint64_t NewEnvId();
+
+			int numa_node;
+			std::vector<int> numa_cpus;
+			std::uint64_t instance_id;
+			/* Bounce buffers handed out to threads; shared with them so the
+			 * env and a thread exiting can each free what the other has not. */
+			std::shared_ptr<OSLBounceSet> bounce_set;
+
+			OSLFile *RefFile(const std::string &fname);
+			void UnlinkFile(const std::string &fname);
+			void ReleaseFile(OSLFile *oslfile);
+
+			/* Hands every LBA the env holds back to a shared device: reserved
+			 * for the tenant if its namespace was saved, so no other tenant
+			 * can overwrite them before it is opened again, free otherwise. */
+			void ReturnLBAs(bool saved);
+
+			void InitNumaNode();
+			void ReleaseBounceBuffers();
 			bool IsFilePosix(const std::string &fname)
 			{
 				return (fname.find("uuid") != std::string::npos ||
@@ -305,38 +1285,199 @@ namespace rocksdb
 			}
 	};
 
+	/* Puts and deletes for OSLEnv::KVWrite. Consecutive operations of the
+	 * same kind are submitted together, MAX_KV_BATCH per command. */
+	class OSLKVWriteBatch
+	{
+		public:
+			struct Op
+			{
+				char command;
+				std::string key;
+				std::string value;
+			};
+
+			void Put(const Slice &key, const Slice &value)
+			{
+				ops_.push_back(Op{PUTOBJECT, key.ToString(), value.ToString()});
+			}
+
+			void Delete(const Slice &key)
+			{
+				ops_.push_back(Op{DELETEOBJECT, key.ToString(), std::string()});
+			}
+
+			void Clear()
+			{
+				ops_.clear();
+			}
+
+			size_t Count() const
+			{
+				return ops_.size();
+			}
+
+			const std::vector<Op> &Ops() const
+			{
+				return ops_;
+			}
+
+		private:
+			std::vector<Op> ops_;
+	};
+
+	/* Per-thread free lists of fixed size blocks for file handles, which the
+	 * table cache opens and closes at a high rate. A block freed on another
+	 * thread joins that thread's list; each keeps at most OSL_POOL_CACHED. */
+	template <typename T>
+	class OSLHandlePool
+	{
+		public:
+			static void *Allocate(size_t size)
+			{
+				FreeList *list = List();
+
+				if (size != sizeof(T) || list == NULL || list->head == NULL)
+				{
+					return ::operator new(size);
+				}
+
+				Node *node = list->head;
+				list->head = node->next;
+				list->count--;
+				return node;
+			}
+
+			static void Free(void *p, size_t size)
+			{
+				FreeList *list = List();
+
+				if (size != sizeof(T) || list == NULL || list->count >= OSL_POOL_CACHED)
+				{
+					::operator delete(p);
+					return;
+				}
+
+				Node *node = static_cast<Node *>(p);
+				node->next = list->head;
+				list->head = node;
+				list->count++;
+			}
+
+		private:
+			struct Node
+			{
+				Node *next;
+			};
+
+			struct FreeList
+			{
+				Node *head = NULL;
+				size_t count = 0;
+
+				~FreeList()
+				{
+					while (head)
+					{
+						Node *node = head;
+						head = node->next;
+						::operator delete(node);
+					}
+					Destroyed() = true;
+				}
+			};
+
+			/* Trivially destructible, so still valid while thread_locals with
+			 * destructors are torn down: handles freed after the list go
+			 * straight to ::operator delete. */
+			static bool &Destroyed()
+			{
+				static thread_local bool destroyed = false;
+				return destroyed;
+			}
+
+			/* NULL once the calling thread's list is destroyed. */
+			static FreeList *List()
+			{
+				if (Destroyed())
+				{
+					return NULL;
+				}
+
+				static thread_local FreeList list;
+				return &list;
+			}
+	};
+
 	/* ### SequentialFile, RandAccessFile, and Writable File ### */
 
+	/* Reads are served from a readahead window, [ra_off, ra_off + ra_len)
+	 * in ra_buf, while the window after it is fetched into ra_next_buf in
+	 * the background. The window doubles, from OSL_READAHEAD_MIN up to
+	 * OSL_READAHEAD_MAX, each time the reader moves on to the prefetched
+	 * one, and starts over after a jump. */
 	class OSLSequentialFile : public SequentialFile
 	{
 		private:
-			std::string filename_;
 			bool use_direct_io_;
 			size_t logical_sector_size_;
 			OSLFile *oslfile;
 			OSLEnv *env_osl;
 			uint64_t read_off;
 
+			char *ra_buf;
+			uint64_t ra_off;
+			size_t ra_len;
+			size_t ra_window;
+
+			char *ra_next_buf;
+			uint64_t ra_next_off;
+			size_t ra_next_len;
+			std::future<Status> ra_pending;
+
 		public:
-			OSLSequentialFile(const std::string &fname, OSLEnv *osl,
-					const EnvOptions &options)
-				: filename_(fname),
-				use_direct_io_(options.use_direct_reads),
+			/* Takes over a reference to file. */
+			OSLSequentialFile(OSLFile *file, OSLEnv *osl, const EnvOptions &options)
+				: use_direct_io_(options.use_direct_reads),
 				logical_sector_size_(OSL_ALIGMENT)
 				{
 					env_osl = osl;
 					read_off = 0;
-					oslfile = env_osl->files[fname];
+					oslfile = file;
+
+					ra_buf = NULL;
+					ra_off = 0;
+					ra_len = 0;
+					ra_window = OSL_READAHEAD_MIN;
+					ra_next_buf = NULL;
+					ra_next_off = 0;
+					ra_next_len = 0;
 				}
 
 			virtual ~OSLSequentialFile()
 			{
+				if (ra_pending.valid())
+				{
+					ra_pending.wait();
+				}
+				if (ra_buf)
+				{
+					env_osl->FreeIOBuffer(ra_buf, OSL_READAHEAD_MAX);
+				}
+				if (ra_next_buf)
+				{
+					env_osl->FreeIOBuffer(ra_next_buf, OSL_READAHEAD_MAX);
+				}
+				env_osl->UnrefFile(oslfile);
 			}
 
 			/* ### Implemented at env_osl_io.cc ### */
 
-			Status ReadOffset(uint64_t offset, size_t n, Slice *result, char *scratch,
-					size_t *readLen) const;
+			Status ReadOffset(uint64_t offset, size_t n, Slice *result, char *scratch);
+
+			Status FillWindow(uint64_t offset);
+
+			void StartReadahead(uint64_t offset);
 
 			Status Read(size_t n, Slice *result, char *scratch) override;
 
@@ -363,28 +1504,35 @@ namespace rocksdb
 	class OSLRandomAccessFile : public RandomAccessFile
 	{
 		private:
-			std::string filename_;
 			bool use_direct_io_;
 			size_t logical_sector_size_;
-			std::uint64_t uuididx;
 
 			OSLEnv *env_osl;
 			OSLFile *oslfile;
 
 		public:
-			OSLRandomAccessFile(const std::string &fname, OSLEnv *osl,
-					const EnvOptions &options)
-				: filename_(fname),
-				use_direct_io_(options.use_direct_reads),
+			/* Takes over a reference to file. */
+			OSLRandomAccessFile(OSLFile *file, OSLEnv *osl, const EnvOptions &options)
+				: use_direct_io_(options.use_direct_reads),
 				logical_sector_size_(OSL_ALIGMENT),
-				uuididx(0),
-				env_osl(osl)
-		{
-
-			oslfile = env_osl->files[filename_];
+				env_osl(osl),
+				oslfile(file)
+				{
+				}
 
 			virtual ~OSLRandomAccessFile()
 			{
+				env_osl->UnrefFile(oslfile);
+			}
+
+			static void *operator new(size_t size)
+			{
+				return OSLHandlePool<OSLRandomAccessFile>::Allocate(size);
+			}
+
+			static void operator delete(void *p, size_t size)
+			{
+				OSLHandlePool<OSLRandomAccessFile>::Free(p, size);
 			}
 
 			/* ### Implemented at env_osl_io.cc ### */
@@ -427,15 +1575,28 @@ namespace rocksdb
 				OSLFile *oslfile;
 				size_t logical_sector_size_;
 
+				/* Starts at one huge page and doubles up to OSL_MAX_BUF. */
 				char *write_cache;
 				char *cache_off;
+				size_t cache_cap;
+
+				/* File offset of write_cache[0] (always block aligned) and the
+				 * running CRC32C of every block held in the cache. */
+				std::uint64_t cache_base;
+				std::vector<uint32_t> cache_crcs;
+				size_t block_size_;
+
+				/* File size as of the last Sync, or OSL_UNSYNCED once a
+				 * Truncate cut below it. */
+				std::uint64_t synced_size_;
 
 				OSLEnv *env_osl;
 				std::uint64_t map_off;
 
 			public:
-				explicit OSLWritableFile(const std::string &fname, OSLEnv *osl,
-						const EnvOptions &options)
+				/* Takes over a reference to file. */
+				explicit OSLWritableFile(const std::string &fname, OSLFile *file,
+						OSLEnv *osl, const EnvOptions &options)
 					: WritableFile(options),
 					filename_(fname),
 					use_direct_io_(options.use_direct_writes),
@@ -445,23 +1606,29 @@ namespace rocksdb
 					env_osl(osl)
 					{
 
-						write_cache = (char *)malloc(OSL_MAX_BUF);
+						cache_cap = OSL_HUGE_PAGE;
+						write_cache = env_osl->AllocIOBuffer(cache_cap);
 						if (!write_cache)
 						{
-							std::cout << " malloc error." << std::endl;
+							std::cout << " write cache allocation error." << std::endl;
 							cache_off = nullptr;
 						}
 
 						cache_off = write_cache;
+						cache_base = 0;
 						map_off = 0;
+						synced_size_ = 0;
 
-						oslfile = env_osl->files[fname];
+						oslfile = file;
+						block_size_ = oslfile->BlockSize();
+						cache_crcs.resize(cache_cap / block_size_, 0);
 					}
 
 				virtual ~OSLWritableFile()
 				{
 					if (write_cache)
-						free(write_cache);
+						env_osl->FreeIOBuffer(write_cache, cache_cap);
+					env_osl->UnrefFile(oslfile);
 				}
 
 				/* ### Implemented at env_osl_io.cc ### */
@@ -473,6 +1640,14 @@ namespace rocksdb
 				Status PositionedAppend(const rocksdb::Slice &, uint64_t,
 						const rocksdb::DataVerificationInfo &);
 
+				Status CopyToCache(const char *src, size_t n, uint32_t *crc);
+
+				Status GrowCache();
+
+				Status SyncPacked(size_t size);
+
+				OSLIOClass GetIOClass();
+
 				Status Truncate(std::uint64_t size) override;
 
 				Status Close() override;
@@ -511,4 +1686,14 @@ namespace rocksdb
 
 			Status NewOSLEnv(Env **osl_env, const std::string &dev_name);
 
+			Status NewOSLEnv(Env **osl_env, const std::string &dev_name,
+					const OSLEnvOptions &options);
+
+			/* Splits osl://<device>[?key=value&...] into the device name and
+			 * OSLEnvOptions; keys are the option field names. Implemented at
+			 * env_osl_registry.cc, which also registers the scheme with the
+			 * ObjectRegistry (see osl.mk). */
+			Status ParseOSLEnvURI(const std::string &uri, std::string *dev_name,
+					OSLEnvOptions *opts);
+
 	} // namespace rocksdb
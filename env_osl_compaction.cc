@@ -0,0 +1,275 @@
+#include <string.h>
+
+#include <iostream>
+#include <set>
+
+#include "db/compaction/compaction_job.h"
+#include "env_osl_compaction.h"
+
+namespace rocksdb
+{
+
+	OSLCompactionService::OSLCompactionService(OSLEnv *env)
+		: env_(env), offloaded_(0)
+	{
+	}
+
+	CompactionServiceJobStatus OSLCompactionService::StartV2(
+			const CompactionServiceJobInfo &info,
+			const std::string &compaction_service_input)
+	{
+		CompactionServiceInput input;
+		Status s = CompactionServiceInput::Read(compaction_service_input, &input);
+		if (!s.ok())
+		{
+			std::cout << __func__ << " job " << info.job_id
+				<< " unreadable input, compacting locally" << std::endl;
+			return CompactionServiceJobStatus::kUseLocal;
+		}
+
+		std::unique_ptr<Job> job(new Job());
+		job->input = compaction_service_input;
+		job->db_path = info.db_name;
+		job->output_path = info.db_name + "/osl_compaction_" +
+			std::to_string(info.job_id);
+
+		size_t pages = 0;
+		bool local = false;
+		std::unique_lock<std::mutex> files_lock(env_->files_mutex);
+		for (const std::string &name : input.input_files)
+		{
+			std::string fname = info.db_name + "/" + name;
+			auto it = env_->files.find(fname);
+
+			/* Packed files share their pages, so they cannot be shipped as
+			 * extents, and extents list single pages. */
+			if (it == env_->files.end() || it->second == NULL ||
+					it->second->packed || it->second->block_pages != 1 ||
+					fname.size() >= MAX_OBJECT_NAME)
+			{
+				local = true;
+				break;
+			}
+
+			OSLFile *oslfile = it->second;
+			oslfile->Ref();
+			job->refs.push_back(oslfile);
+			struct csd_extent extent;
+
+			memset(&extent, 0, sizeof(extent));
+			extent.uuididx = oslfile->uuididx;
+			extent.size = oslfile->synced_size;
+			extent.first = job->input_lbas.size();
+			extent.nlbas = oslfile->lbas.size();
+			memcpy(extent.name, fname.data(), fname.size());
+
+			job->inputs.push_back(extent);
+			job->input_lbas.insert(job->input_lbas.end(), oslfile->lbas.begin(),
+					oslfile->lbas.end());
+			job->input_crcs.insert(job->input_crcs.end(),
+					oslfile->page_crcs.begin(), oslfile->page_crcs.end());
+			pages += oslfile->lbas.size();
+		}
+		files_lock.unlock();
+
+		if (local)
+		{
+			ReleaseInputs(job.get());
+			return CompactionServiceJobStatus::kUseLocal;
+		}
+
+		/* Outputs rarely exceed the inputs; leave room for block padding
+		 * and partial last pages. */
+		size_t pool = pages + pages / 8 + 16;
+		s = env_->AllocateLBAs(pool, &job->pool);
+		if (!s.ok())
+		{
+			env_->FreeLBAs(job->pool);
+			ReleaseInputs(job.get());
+			return CompactionServiceJobStatus::kUseLocal;
+		}
+
+		s = env_->CreateDirIfMissing(job->output_path);
+		if (!s.ok())
+		{
+			env_->FreeLBAs(job->pool);
+			ReleaseInputs(job.get());
+			return CompactionServiceJobStatus::kUseLocal;
+		}
+
+		std::lock_guard<std::mutex> lock(mutex_);
+		jobs_[info.job_id] = std::move(job);
+
+		return CompactionServiceJobStatus::kSuccess;
+	}
+
+	CompactionServiceJobStatus OSLCompactionService::WaitForCompleteV2(
+			const CompactionServiceJobInfo &info,
+			std::string *compaction_service_result)
+	{
+		std::unique_ptr<Job> job;
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			auto it = jobs_.find(info.job_id);
+			if (it == jobs_.end())
+			{
+				return CompactionServiceJobStatus::kFailure;
+			}
+			job = std::move(it->second);
+			jobs_.erase(it);
+		}
+
+		const unsigned int max_outputs = 1024;
+		std::vector<struct csd_extent> outputs(max_outputs);
+		std::vector<uint32_t> output_lbas(job->pool.size());
+		std::vector<uint32_t> output_crcs(job->pool.size());
+		std::string result(1 << 20, '\0');
+		struct csd_compaction_job request;
+		struct csd_params parameters;
+
+		memset(&request, 0, sizeof(request));
+		request.job_id = info.job_id;
+		request.db_path = job->db_path.c_str();
+		request.output_path = job->output_path.c_str();
+		request.input = job->input.data();
+		request.input_len = job->input.size();
+		request.inputs = job->inputs.data();
+		request.ninputs = job->inputs.size();
+		request.input_lbas = job->input_lbas.data();
+		request.input_crcs = job->input_crcs.data();
+		request.lba_pool = job->pool.data();
+		request.pool_size = job->pool.size();
+		request.outputs = outputs.data();
+		request.max_outputs = max_outputs;
+		request.output_lbas = output_lbas.data();
+		request.output_crcs = output_crcs.data();
+		request.result = &result[0];
+		request.result_cap = result.size();
+
+		parameters.ObjectID = 1;
+		parameters.lba = 0;
+		parameters.data_pointer = (char *)&request;
+		parameters.buffer1.command[0] = COMPACTOBJECT;
+
+		/* The job occupies one device slot for its whole run. It writes
+		 * about as much as it reads, so it is charged its input bytes as a
+		 * background write: the tenant's token bucket and fair share apply
+		 * as they do to a compaction run on the host. */
+		size_t input_bytes = 0;
+		for (const struct csd_extent &in : job->inputs)
+		{
+			input_bytes += in.size;
+		}
+		OSLIOScheduler *sched = env_->GetIOScheduler();
+		sched->Acquire(env_->GetIOTenant(), OSL_IO_COMPACTION, input_bytes, true);
+		long ret = env_->GetTransport()->Submit(&parameters);
+		sched->Release();
+		ReleaseInputs(job.get());
+
+		std::vector<std::string> registered;
+		if (ret || request.result_len > request.result_cap ||
+				request.noutputs > max_outputs)
+		{
+			std::cout << __func__ << " job " << info.job_id << " failed on device: "
+				<< ret << std::endl;
+			env_->FreeLBAs(job->pool);
+			DropOutputs(job.get(), registered);
+			return CompactionServiceJobStatus::kFailure;
+		}
+		result.resize(request.result_len);
+
+		CompactionServiceResult parsed;
+		Status s = CompactionServiceResult::Read(result, &parsed);
+		if (!s.ok() || parsed.output_files.size() != request.noutputs)
+		{
+			std::cout << __func__ << " job " << info.job_id
+				<< " returned an inconsistent result" << std::endl;
+			env_->FreeLBAs(job->pool);
+			DropOutputs(job.get(), registered);
+			return CompactionServiceJobStatus::kFailure;
+		}
+
+		/* Register what the device wrote; the rest of the pool goes back. */
+		std::set<uint32_t> pool(job->pool.begin(), job->pool.end());
+		std::set<uint32_t> used;
+		for (unsigned int i = 0; i < request.noutputs && s.ok(); i++)
+		{
+			const struct csd_extent &out = outputs[i];
+			std::string name(out.name, strnlen(out.name, MAX_OBJECT_NAME));
+
+			if ((size_t)out.first + out.nlbas > job->pool.size())
+			{
+				s = Status::Corruption("OSL compaction output outside lba pool");
+				break;
+			}
+
+			for (unsigned int j = out.first; j < out.first + out.nlbas; j++)
+			{
+				if (!pool.count(output_lbas[j]) || used.count(output_lbas[j]))
+				{
+					s = Status::Corruption("OSL compaction output outside lba pool");
+				}
+			}
+			if (!s.ok())
+			{
+				break;
+			}
+
+			s = env_->RegisterFile(job->output_path + "/" + name, out.size,
+					&output_lbas[out.first], &output_crcs[out.first], out.nlbas);
+			if (!s.ok())
+			{
+				break;
+			}
+			registered.push_back(job->output_path + "/" + name);
+			used.insert(&output_lbas[out.first], &output_lbas[out.first + out.nlbas]);
+		}
+
+		std::vector<uint32_t> unused;
+		for (uint32_t lba : job->pool)
+		{
+			if (!used.count(lba))
+			{
+				unused.push_back(lba);
+			}
+		}
+		env_->FreeLBAs(unused);
+
+		if (!s.ok())
+		{
+			std::cout << __func__ << " job " << info.job_id << " outputs rejected: "
+				<< s.ToString() << std::endl;
+			DropOutputs(job.get(), registered);
+			return CompactionServiceJobStatus::kFailure;
+		}
+
+		/* The outputs live in OSLEnv::files, not in the posix directory, so
+		 * it is empty and RocksDB can still rename them out of it. */
+		env_->DeleteDir(job->output_path);
+
+		offloaded_++;
+		compaction_service_result->swap(result);
+		return CompactionServiceJobStatus::kSuccess;
+	}
+
+	/* Called without files_mutex: the last reference frees the file. */
+	void OSLCompactionService::ReleaseInputs(Job *job)
+	{
+		for (OSLFile *oslfile : job->refs)
+		{
+			env_->UnrefFile(oslfile);
+		}
+		job->refs.clear();
+	}
+
+	void OSLCompactionService::DropOutputs(Job *job,
+			const std::vector<std::string> &outputs)
+	{
+		for (const std::string &fname : outputs)
+		{
+			env_->DeleteFile(fname);
+		}
+		env_->DeleteDir(job->output_path);
+	}
+
+} // namespace rocksdb
@@ -0,0 +1,77 @@
+#pragma once
+
+#include <atomic>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "env_osl.h"
+#include "rocksdb/options.h"
+
+namespace rocksdb
+{
+
+	/* ### Near-data compaction ### */
+
+	/* Runs RocksDB remote compactions on the CSD. StartV2 resolves the input
+	 * SSTs to their extents (named by uuididx) and reserves a pool of LBAs for
+	 * the outputs; WaitForCompleteV2 sends one COMPACTOBJECT job and registers
+	 * the output files the device reports in OSLEnv::files, returning unused
+	 * pool LBAs. Jobs whose inputs are not all on the CSD run locally. */
+	class OSLCompactionService : public CompactionService
+	{
+		public:
+			explicit OSLCompactionService(OSLEnv *env);
+
+			static const char *kClassName()
+			{
+				return "OSLCompactionService";
+			}
+
+			const char *Name() const override
+			{
+				return kClassName();
+			}
+
+			CompactionServiceJobStatus StartV2(const CompactionServiceJobInfo &info,
+					const std::string &compaction_service_input) override;
+
+			CompactionServiceJobStatus WaitForCompleteV2(
+					const CompactionServiceJobInfo &info,
+					std::string *compaction_service_result) override;
+
+			/* Jobs the device completed and whose outputs were registered. */
+			std::uint64_t GetOffloadedJobs() const
+			{
+				return offloaded_;
+			}
+
+		private:
+			struct Job
+			{
+				std::string input;
+				std::string db_path;
+				std::string output_path;
+				std::vector<struct csd_extent> inputs;
+				std::vector<uint32_t> input_lbas;
+				std::vector<uint32_t> input_crcs;
+				std::vector<uint32_t> pool;
+				/* Referenced until the device is done with their extents. */
+				std::vector<OSLFile *> refs;
+			};
+
+			void ReleaseInputs(Job *job);
+
+			/* Deletes the outputs registered so far and the output
+			 * directory of a job that failed. */
+			void DropOutputs(Job *job, const std::vector<std::string> &outputs);
+
+			OSLEnv *env_;
+			std::atomic<std::uint64_t> offloaded_;
+			std::mutex mutex_;
+			std::map<std::uint64_t, std::unique_ptr<Job>> jobs_;
+	};
+
+} // namespace rocksdb
@@ -0,0 +1,325 @@
+#include <algorithm>
+#include <iostream>
+
+#include "env_osl.h"
+
+namespace rocksdb
+{
+
+	/* ### Process-wide device table ### */
+
+	/* Devices with at least one tenant attached, by dev_name. */
+	static std::mutex osl_devices_mutex;
+	static std::map<std::string, std::weak_ptr<OSLDevice>> osl_devices;
+
+	OSLDevice::OSLDevice(const std::string &dev_name, const OSLEnvOptions &opts)
+		: dev_name_(dev_name), io_scheduler_(opts.queue_depth)
+	{
+		transport_ = opts.transport ? opts.transport
+			: std::make_shared<OSLSyscallTransport>();
+
+		std::uint64_t bytes = opts.device_bytes ? opts.device_bytes
+			: transport_->CapacityBytes();
+		if (bytes == 0)
+		{
+			std::cout << "OSL device " << dev_name << ": capacity unknown, using "
+				<< OSL_DEFAULT_DEVICE_LBAS << " lbas; set device_bytes" << std::endl;
+			bytes = (std::uint64_t)OSL_DEFAULT_DEVICE_LBAS * OSL_ALIGMENT;
+		}
+		capacity_lbas_ = (std::uint32_t)std::min<std::uint64_t>(
+				bytes / OSL_ALIGMENT, UINT32_MAX);
+		if (capacity_lbas_)
+		{
+			free_lbas_.emplace(0, capacity_lbas_);
+		}
+	}
+
+	Status OSLDevice::Attach(const std::string &dev_name, const OSLEnvOptions &opts,
+			std::shared_ptr<OSLDevice> *device)
+	{
+		std::lock_guard<std::mutex> lock(osl_devices_mutex);
+
+		std::shared_ptr<OSLDevice> shared = osl_devices[dev_name].lock();
+		if (!shared)
+		{
+			shared = std::make_shared<OSLDevice>(dev_name, opts);
+			osl_devices[dev_name] = shared;
+		}
+		else if (opts.transport && opts.transport != shared->transport_)
+		{
+			return Status::InvalidArgument("OSL device is attached with another "
+					"transport", dev_name);
+		}
+
+		{
+			std::lock_guard<std::mutex> tenants_lock(shared->tenants_mutex_);
+			auto &tenants = shared->tenants_;
+
+			if (std::find(tenants.begin(), tenants.end(), opts.tenant) != tenants.end())
+			{
+				return Status::InvalidArgument("OSL tenant is already attached to " +
+						dev_name, opts.tenant);
+			}
+			tenants.push_back(opts.tenant);
+		}
+
+		std::cout << "OSL device " << dev_name << ": tenant " << opts.tenant
+			<< " attached" << std::endl;
+		*device = shared;
+		return Status::OK();
+	}
+
+	void OSLDevice::Detach(const std::string &tenant)
+	{
+		std::lock_guard<std::mutex> lock(tenants_mutex_);
+
+		auto it = std::find(tenants_.begin(), tenants_.end(), tenant);
+		if (it != tenants_.end())
+		{
+			tenants_.erase(it);
+		}
+	}
+
+	/* ### LBA allocator ### */
+
+	/* Single LBAs come off the top of the highest run; longer runs are
+	 * carved, aligned, out of the lowest run that holds one, so that small
+	 * allocations do not break up the space large blocks need. */
+	bool OSLDevice::TakeFreeRun(std::uint32_t run, uint32_t *first)
+	{
+		if (free_lbas_.empty())
+		{
+			return false;
+		}
+
+		if (run == 1)
+		{
+			auto last = std::prev(free_lbas_.end());
+			*first = last->first + last->second - 1;
+			if (--last->second == 0)
+			{
+				free_lbas_.erase(last);
+			}
+			return true;
+		}
+
+		for (auto it = free_lbas_.begin(); it != free_lbas_.end(); it++)
+		{
+			uint32_t start = it->first;
+			uint32_t end = start + it->second;
+			uint32_t aligned = (start + run - 1) / run * run;
+
+			if (aligned + run > end)
+			{
+				continue;
+			}
+
+			free_lbas_.erase(it);
+			if (aligned > start)
+			{
+				free_lbas_.emplace(start, aligned - start);
+			}
+			if (aligned + run < end)
+			{
+				free_lbas_.emplace(aligned + run, end - aligned - run);
+			}
+			*first = aligned;
+			return true;
+		}
+
+		return false;
+	}
+
+	void OSLDevice::InsertFreeRun(uint32_t first, std::uint32_t len)
+	{
+		auto next = free_lbas_.lower_bound(first);
+
+		if (next != free_lbas_.end() && first + len == next->first)
+		{
+			len += next->second;
+			next = free_lbas_.erase(next);
+		}
+
+		if (next != free_lbas_.begin())
+		{
+			auto prev = std::prev(next);
+			if (prev->first + prev->second == first)
+			{
+				prev->second += len;
+				return;
+			}
+		}
+
+		free_lbas_.emplace_hint(next, first, len);
+	}
+
+	Status OSLDevice::AllocateLBA(uint32_t *lba)
+	{
+		std::lock_guard<std::mutex> lock(lba_mutex_);
+
+		if (!TakeFreeRun(1, lba))
+		{
+			return Status::NoSpace("OSL device has no free lbas");
+		}
+		return Status::OK();
+	}
+
+	Status OSLDevice::AllocateLBAs(size_t count, std::vector<uint32_t> *lbas,
+			std::uint32_t run)
+	{
+		std::lock_guard<std::mutex> lock(lba_mutex_);
+		size_t taken = 0;
+
+		for (; taken < count; taken++)
+		{
+			uint32_t first;
+			if (!TakeFreeRun(run, &first))
+			{
+				break;
+			}
+			lbas->push_back(first);
+		}
+
+		if (taken < count)
+		{
+			for (size_t i = lbas->size() - taken; i < lbas->size(); i++)
+			{
+				InsertFreeRun((*lbas)[i], run);
+			}
+			lbas->resize(lbas->size() - taken);
+			return Status::NoSpace("OSL device has no free lbas");
+		}
+		return Status::OK();
+	}
+
+	void OSLDevice::FreeLBAs(const std::vector<uint32_t> &lbas, std::uint32_t run)
+	{
+		std::lock_guard<std::mutex> lock(lba_mutex_);
+
+		for (auto it = lbas.begin(); it != lbas.end(); it++)
+		{
+			InsertFreeRun(*it, run);
+		}
+	}
+
+	size_t OSLDevice::FreeLBACount()
+	{
+		std::lock_guard<std::mutex> lock(lba_mutex_);
+		size_t count = 0;
+
+		for (auto it = free_lbas_.begin(); it != free_lbas_.end(); it++)
+		{
+			count += it->second;
+		}
+		return count;
+	}
+
+	/* Adjacent free runs are always merged, so a range is free only if it
+	 * lies within a single run. */
+	bool OSLDevice::IsFreeRange(uint32_t first, std::uint32_t len)
+	{
+		auto it = free_lbas_.upper_bound(first);
+		return it != free_lbas_.begin() &&
+			std::prev(it)->first + std::prev(it)->second >= first + len;
+	}
+
+	void OSLDevice::TakeRange(uint32_t first, std::uint32_t len)
+	{
+		auto it = std::prev(free_lbas_.upper_bound(first));
+		uint32_t start = it->first;
+		uint32_t end = start + it->second;
+
+		free_lbas_.erase(it);
+		if (first > start)
+		{
+			free_lbas_.emplace(start, first - start);
+		}
+		if (first + len < end)
+		{
+			free_lbas_.emplace(first + len, end - first - len);
+		}
+	}
+
+	/* The tenant's reserved LBAs are made free first, and taken back if
+	 * the claim fails, so it can only ever fail as a whole. */
+	Status OSLDevice::ClaimLBAs(const std::string &tenant, std::vector<uint32_t> lbas)
+	{
+		std::vector<std::pair<uint32_t, uint32_t>> ranges;
+
+		std::sort(lbas.begin(), lbas.end());
+		for (size_t i = 0; i < lbas.size(); i++)
+		{
+			if (i > 0 && lbas[i] == lbas[i - 1])
+			{
+				return Status::Corruption("OSL lba claimed twice", dev_name_);
+			}
+			if (!ranges.empty() &&
+					ranges.back().first + ranges.back().second == lbas[i])
+			{
+				ranges.back().second++;
+			}
+			else
+			{
+				ranges.push_back(std::make_pair(lbas[i], 1));
+			}
+		}
+
+		std::lock_guard<std::mutex> lock(lba_mutex_);
+		std::vector<uint32_t> reserved;
+
+		auto it = reserved_lbas_.find(tenant);
+		if (it != reserved_lbas_.end())
+		{
+			reserved.swap(it->second);
+			reserved_lbas_.erase(it);
+		}
+		for (uint32_t lba : reserved)
+		{
+			InsertFreeRun(lba, 1);
+		}
+
+		for (auto &range : ranges)
+		{
+			if (!IsFreeRange(range.first, range.second))
+			{
+				for (uint32_t lba : reserved)
+				{
+					TakeRange(lba, 1);
+				}
+				if (!reserved.empty())
+				{
+					reserved_lbas_[tenant].swap(reserved);
+				}
+				return Status::Corruption("OSL lba is not free", dev_name_);
+			}
+		}
+
+		for (auto &range : ranges)
+		{
+			TakeRange(range.first, range.second);
+		}
+
+		return Status::OK();
+	}
+
+	void OSLDevice::ReserveLBAs(const std::string &tenant,
+			const std::vector<uint32_t> &lbas)
+	{
+		std::lock_guard<std::mutex> lock(lba_mutex_);
+		std::vector<uint32_t> &reserved = reserved_lbas_[tenant];
+
+		reserved.insert(reserved.end(), lbas.begin(), lbas.end());
+	}
+
+	void OSLDevice::ResetFreeLBAs(const std::vector<uint32_t> &lbas)
+	{
+		std::lock_guard<std::mutex> lock(lba_mutex_);
+
+		free_lbas_.clear();
+		for (uint32_t lba : lbas)
+		{
+			InsertFreeRun(lba, 1);
+		}
+	}
+
+} // namespace rocksdb
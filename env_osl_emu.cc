@@ -0,0 +1,285 @@
+#include <errno.h>
+#include <string.h>
+
+#include <iostream>
+
+#include "db/compaction/compaction_job.h"
+#include "env_osl_compaction.h"
+#include "env_osl_emu.h"
+#include "rocksdb/db.h"
+
+namespace rocksdb
+{
+
+	long OSLEmulatedDevice::Submit(struct csd_params *parameters)
+	{
+		char command = parameters->buffer1.command[0];
+
+		switch (command)
+		{
+			case READ:
+			case WRITE:
+				return SubmitPage(command, parameters->lba, parameters->data_pointer,
+						parameters->ObjectID > 1 ? parameters->ObjectID : 1);
+			case GETOBJECT:
+			case PUTOBJECT:
+			case DELETEOBJECT:
+				return SubmitObjects(command,
+						(struct csd_kv_object *)parameters->data_pointer,
+						parameters->ObjectID);
+			case COMPACTOBJECT:
+				return SubmitCompaction(
+						(struct csd_compaction_job *)parameters->data_pointer);
+			default:
+				errno = EINVAL;
+				return -1;
+		}
+	}
+
+	long OSLEmulatedDevice::SubmitPage(char command, uint32_t lba, char *buf,
+			uint32_t npages)
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+
+		for (uint32_t i = 0; i < npages; i++, buf += OSL_ALIGMENT)
+		{
+			if (command == WRITE)
+			{
+				pages_[lba + i].assign(buf, OSL_ALIGMENT);
+				continue;
+			}
+
+			auto it = pages_.find(lba + i);
+			if (it == pages_.end())
+			{
+				memset(buf, 0, OSL_ALIGMENT);
+			}
+			else
+			{
+				memcpy(buf, it->second.data(), OSL_ALIGMENT);
+			}
+		}
+		return 0;
+	}
+
+	long OSLEmulatedDevice::SubmitObjects(char command,
+			struct csd_kv_object *objects, int count)
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+
+		for (int i = 0; i < count; i++)
+		{
+			struct csd_kv_object &object = objects[i];
+			std::string key(object.key, object.key_len);
+
+			object.status = 0;
+			if (command == PUTOBJECT)
+			{
+				objects_[key].assign(object.value, object.value_len);
+				continue;
+			}
+
+			auto it = objects_.find(key);
+			if (it == objects_.end())
+			{
+				object.status = -ENOENT;
+			}
+			else if (command == DELETEOBJECT)
+			{
+				objects_.erase(it);
+			}
+			else if (it->second.size() > object.value_len)
+			{
+				object.status = -EMSGSIZE;
+			}
+			else
+			{
+				memcpy(object.value, it->second.data(), it->second.size());
+				object.value_len = it->second.size();
+			}
+		}
+		return 0;
+	}
+
+	/* Runs the job the way the device would: a device-side OSLEnv knows only
+	 * the input extents and may only allocate from the job's LBA pool, so the
+	 * outputs reach the host exclusively through the returned extents. */
+	long OSLEmulatedDevice::SubmitCompaction(struct csd_compaction_job *job)
+	{
+		OSLEnvOptions opts;
+		opts.numa_aware = false;
+		opts.use_huge_pages = false;
+		opts.pack_threshold = 0;
+		opts.sst_block_size = OSL_ALIGMENT;
+		opts.transport = shared_from_this();
+
+		OSLEnv device_env("osl-emulated", opts);
+		device_env.GetDevice()->ResetFreeLBAs(std::vector<uint32_t>(job->lba_pool,
+					job->lba_pool + job->pool_size));
+
+		for (unsigned int i = 0; i < job->ninputs; i++)
+		{
+			const struct csd_extent &in = job->inputs[i];
+			Status s = device_env.RegisterFile(
+					std::string(in.name, strnlen(in.name, MAX_OBJECT_NAME)), in.size,
+					job->input_lbas + in.first, job->input_crcs + in.first, in.nlbas);
+			if (!s.ok())
+			{
+				errno = EINVAL;
+				return -1;
+			}
+		}
+
+		CompactionServiceOptionsOverride override_options = compaction_options_;
+		override_options.env = &device_env;
+
+		std::string output;
+		Status s = DB::OpenAndCompact(job->db_path, job->output_path,
+				std::string(job->input, job->input_len), &output, override_options);
+		if (!s.ok())
+		{
+			std::cout << __func__ << " job " << job->job_id << " failed: "
+				<< s.ToString() << std::endl;
+			errno = EIO;
+			return -1;
+		}
+
+		CompactionServiceResult result;
+		s = CompactionServiceResult::Read(output, &result);
+		if (!s.ok() || result.output_files.size() > job->max_outputs ||
+				output.size() > job->result_cap)
+		{
+			errno = EOVERFLOW;
+			return -1;
+		}
+
+		unsigned int next = 0;
+		job->noutputs = 0;
+		for (const CompactionServiceOutputFile &file : result.output_files)
+		{
+			std::string fname = std::string(job->output_path) + "/" + file.file_name;
+			auto it = device_env.files.find(fname);
+
+			if (it == device_env.files.end() || it->second == NULL ||
+					file.file_name.size() >= MAX_OBJECT_NAME ||
+					next + it->second->lbas.size() > job->pool_size)
+			{
+				errno = EIO;
+				return -1;
+			}
+
+			OSLFile *oslfile = it->second;
+			struct csd_extent &out = job->outputs[job->noutputs++];
+
+			memset(&out, 0, sizeof(out));
+			memcpy(out.name, file.file_name.data(), file.file_name.size());
+			out.uuididx = oslfile->uuididx;
+			out.size = oslfile->synced_size;
+			out.first = next;
+			out.nlbas = oslfile->lbas.size();
+			memcpy(job->output_lbas + next, oslfile->lbas.data(),
+					out.nlbas * sizeof(uint32_t));
+			memcpy(job->output_crcs + next, oslfile->page_crcs.data(),
+					out.nlbas * sizeof(uint32_t));
+			next += out.nlbas;
+		}
+
+		memcpy(job->result, output.data(), output.size());
+		job->result_len = output.size();
+		return 0;
+	}
+
+	Status CheckOSLCompactionOffload(const std::string &db_path)
+	{
+		std::shared_ptr<OSLEmulatedDevice> device =
+			std::make_shared<OSLEmulatedDevice>();
+
+		/* Packed files cannot be shipped as extents. */
+		OSLEnvOptions env_options;
+		env_options.numa_aware = false;
+		env_options.use_huge_pages = false;
+		env_options.submit_queues = 0;
+		env_options.pack_threshold = 0;
+		env_options.transport = device;
+
+		Env *env = NULL;
+		Status s = NewOSLEnv(&env, "osl-check", env_options);
+		if (!s.ok())
+		{
+			return s;
+		}
+		std::unique_ptr<Env> env_guard(env);
+
+		std::shared_ptr<OSLCompactionService> service =
+			std::make_shared<OSLCompactionService>(static_cast<OSLEnv *>(env));
+
+		Options options;
+		options.env = env;
+		options.create_if_missing = true;
+		options.disable_auto_compactions = true;
+		options.compaction_service = service;
+
+		CompactionServiceOptionsOverride device_options;
+		device_options.comparator = options.comparator;
+		device_options.table_factory = options.table_factory;
+		device->SetCompactionOptions(device_options);
+
+		const int files = 4;
+		const int keys = 1000;
+		DB *db = NULL;
+		s = DB::Open(options, db_path, &db);
+
+		/* Every file covers the whole key range, so none can be trivially
+		 * moved; the last write of a key wins. */
+		for (int f = 0; f < files && s.ok(); f++)
+		{
+			for (int i = 0; i < keys && s.ok(); i++)
+			{
+				s = db->Put(WriteOptions(), "key" + std::to_string(i),
+						"value" + std::to_string(f) + "." + std::to_string(i));
+			}
+			if (s.ok())
+			{
+				s = db->Flush(FlushOptions());
+			}
+		}
+
+		if (s.ok())
+		{
+			s = db->CompactRange(CompactRangeOptions(), NULL, NULL);
+		}
+
+		for (int i = 0; i < keys && s.ok(); i++)
+		{
+			std::string value;
+			s = db->Get(ReadOptions(), "key" + std::to_string(i), &value);
+			if (s.ok() && value != "value" + std::to_string(files - 1) + "." +
+					std::to_string(i))
+			{
+				s = Status::Corruption("OSL compaction check read a stale value",
+						"key" + std::to_string(i));
+			}
+		}
+
+		if (s.ok() && service->GetOffloadedJobs() == 0)
+		{
+			s = Status::Aborted("OSL compaction check ran no job on the device");
+		}
+
+		if (db)
+		{
+			Status close = db->Close();
+			if (s.ok())
+			{
+				s = close;
+			}
+			delete db;
+		}
+		DestroyDB(db_path, options);
+
+		std::cout << __func__ << " " << db_path << ": " << s.ToString()
+			<< std::endl;
+		return s;
+	}
+
+} // namespace rocksdb
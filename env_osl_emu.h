@@ -0,0 +1,67 @@
+#pragma once
+
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+#include "env_osl.h"
+#include "rocksdb/options.h"
+
+#define OSL_EMULATED_DEVICE_BYTES (1024ull * 1024 * 1024)
+
+namespace rocksdb
+{
+
+	/* ### User-space device stand-in ### */
+
+	/* Implements the CSD command set in process memory so OSLEnv can be run
+	 * and verified without the kernel interface: pages for READ/WRITE, a map
+	 * for the object commands, and COMPACTOBJECT executed by a device-side
+	 * OSLEnv that only sees the job's extents and LBA pool. */
+	class OSLEmulatedDevice : public OSLTransport,
+		public std::enable_shared_from_this<OSLEmulatedDevice>
+	{
+		public:
+			explicit OSLEmulatedDevice(std::uint64_t capacity_bytes =
+					OSL_EMULATED_DEVICE_BYTES)
+				: capacity_bytes_(capacity_bytes)
+			{
+			}
+
+			long Submit(struct csd_params *parameters) override;
+
+			/* Pages are kept sparsely in memory; only the LBA range is set. */
+			std::uint64_t CapacityBytes() override
+			{
+				return capacity_bytes_;
+			}
+
+			/* Options the device-side DB is opened with for compaction jobs
+			 * (comparator, table factory, merge operator, ...). */
+			void SetCompactionOptions(const CompactionServiceOptionsOverride &options)
+			{
+				compaction_options_ = options;
+			}
+
+		private:
+			const std::uint64_t capacity_bytes_;
+			std::mutex mutex_;
+			std::unordered_map<uint32_t, std::string> pages_;
+			std::map<std::string, std::string> objects_;
+			CompactionServiceOptionsOverride compaction_options_;
+
+			long SubmitPage(char command, uint32_t lba, char *buf, uint32_t npages);
+			long SubmitObjects(char command, struct csd_kv_object *objects, int count);
+			long SubmitCompaction(struct csd_compaction_job *job);
+	};
+
+	/* End-to-end check of near-data compaction against the stand-in: opens
+	 * a DB at db_path on an OSLEnv over an OSLEmulatedDevice, flushes a few
+	 * overlapping L0 files, compacts them through OSLCompactionService and
+	 * reads every key back. Fails unless a job ran on the device and its
+	 * outputs were registered. The DB is destroyed afterwards. */
+	Status CheckOSLCompactionOffload(const std::string &db_path);
+
+} // namespace rocksdb
@@ -1,67 +1,524 @@
 #include <string.h>
 #include <sys/time.h>
 
+#include <algorithm>
 #include <atomic>
 #include <iostream>
 
+#if defined(__SSE4_2__) && defined(__x86_64__)
+#include <nmmintrin.h>
+#elif defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#endif
+
 #include "env_osl.h"
 #include "rocksdb/options.h"
 #include "rocksdb/slice.h"
+#include "util/coding.h"
+#include "util/crc32c.h"
 
 namespace rocksdb
 {
 
-	/* ### SequentialFile method implementation ### */
+	/* ### Checksum helpers ### */
 
-	Status OSLSequentialFile::ReadOffset(uint64_t offset, size_t n, Slice *result,
-			char *scratch, size_t *readLen) const
+	/* Copies n bytes from src to dst and returns crc extended with the CRC32C
+	 * of those bytes. With hardware CRC32C each word is checksummed while it
+	 * sits in a register, so verification costs no extra pass over memory. */
+	static uint32_t CopyAndExtendCRC32C(char *dst, const char *src, size_t n,
+			uint32_t crc)
 	{
-		size_t piece_off = 0, left, size;
-		int ret;
-		unsigned i;
-		uint64_t off;
+#if defined(__SSE4_2__) && defined(__x86_64__)
+		uint64_t l = crc ^ 0xffffffffu;
+		uint64_t word;
 
-		if (oslfile == NULL || offset >= oslfile->size)
+		while (n >= sizeof(word))
 		{
-			return Status::OK();
+			memcpy(&word, src, sizeof(word));
+			memcpy(dst, &word, sizeof(word));
+			l = _mm_crc32_u64(l, word);
+			src += sizeof(word);
+			dst += sizeof(word);
+			n -= sizeof(word);
+		}
+
+		uint32_t l32 = static_cast<uint32_t>(l);
+		while (n--)
+		{
+			l32 = _mm_crc32_u8(l32, static_cast<uint8_t>(*src));
+			*dst++ = *src++;
+		}
+		return l32 ^ 0xffffffffu;
+#elif defined(__ARM_FEATURE_CRC32)
+		uint32_t l = crc ^ 0xffffffffu;
+		uint64_t word;
+
+		while (n >= sizeof(word))
+		{
+			memcpy(&word, src, sizeof(word));
+			memcpy(dst, &word, sizeof(word));
+			l = __crc32cd(l, word);
+			src += sizeof(word);
+			dst += sizeof(word);
+			n -= sizeof(word);
 		}
 
-		if (offset + n > oslfile->size)
+		while (n--)
 		{
-			n = oslfile->size - offset;
+			l = __crc32cb(l, static_cast<uint8_t>(*src));
+			*dst++ = *src++;
 		}
+		return l ^ 0xffffffffu;
+#else
+		/* No CRC instruction: checksum dst right after the copy while it is
+		 * still hot in cache. */
+		memcpy(dst, src, n);
+		return crc32c::Extend(crc, dst, n);
+#endif
+	}
+
+	/* ### Page engines ### */
 
+	/* Builds and submits one READ/WRITE command. Instantiated for a final
+	 * Transport, the call is direct and inlines down to the system call. */
+	template <typename Transport>
+	static inline Status SubmitPages(Transport *transport, char command,
+			uint32_t lba, char *buf, uint32_t npages)
+	{
 		struct csd_params parameters;
 
-		parameters.buffer1.command[0] = READ;
-		parameters.data_pointer = scratch;
+		parameters.ObjectID = npages > 1 ? npages : 0;
+		parameters.lba = lba;
+		parameters.data_pointer = buf;
+		parameters.buffer1.command[0] = command;
+
+		if (transport->Submit(&parameters))
+		{
+			std::cout << "SubmitLBA command: " << command << " lba: " << lba
+				<< " error: " << errno << std::endl;
+			return Status::IOError("OSL device command failed");
+		}
+
+		return Status::OK();
+	}
+
+	/* Block geometry of a file: a compile-time constant for BlockPages > 0,
+	 * so that block index and offset reduce to shifts and masks, and read
+	 * from the file for BlockPages == 0. */
+	template <std::uint32_t BlockPages>
+	struct OSLBlockGeometry
+	{
+		static constexpr size_t kBlockSize = (size_t)BlockPages * OSL_ALIGMENT;
+
+		static_assert((kBlockSize & (kBlockSize - 1)) == 0,
+				"OSL block sizes are powers of two");
+
+		static constexpr size_t Size(const OSLFile *)
+		{
+			return kBlockSize;
+		}
+
+		static constexpr std::uint32_t Pages(const OSLFile *)
+		{
+			return BlockPages;
+		}
+	};
+
+	template <>
+	struct OSLBlockGeometry<0>
+	{
+		static size_t Size(const OSLFile *oslfile)
+		{
+			return oslfile->BlockSize();
+		}
 
-		for (auto it = oslfile->lbas.begin(); it != oslfile->lbas.end(); it++)
+		static std::uint32_t Pages(const OSLFile *oslfile)
 		{
-			parameters.lba = *it;
-			if (!syscall(__NR_csd_syscall, (void *)&parameters))
+			return oslfile->block_pages;
+		}
+	};
+
+	void OSLEnv::SnapshotBlocks(const OSLFile *oslfile, size_t first, size_t end,
+			std::vector<OSLBlockRef> *blocks)
+	{
+		std::lock_guard<std::mutex> lock(files_mutex);
+		size_t block = oslfile->BlockSize();
+
+		blocks->clear();
+		for (size_t idx = first; idx < end && idx < oslfile->lbas.size() &&
+				(uint64_t)idx * block < oslfile->synced_size; idx++)
+		{
+			blocks->push_back(OSLBlockRef{oslfile->lbas[idx], oslfile->page_crcs[idx],
+					(size_t)std::min<uint64_t>(block,
+						oslfile->synced_size - (uint64_t)idx * block)});
+		}
+	}
+
+	/* Reads [offset, offset + n) of oslfile into scratch block by block.
+	 * Each block is checked against its stored CRC32C in the same pass that
+	 * copies the requested bytes out of the bounce buffer (or the cached
+	 * block); the bytes of a partial block read around the request are
+	 * checksummed without being copied.
+	 *
+	 * The blocks are looked up once, under files_mutex. A live file's tail
+	 * block is rewritten in place by Sync and Truncate; a mismatch against a
+	 * CRC that has been replaced since is read again with the new one. */
+	template <typename Transport, std::uint32_t BlockPages>
+	static Status ReadVerifiedPages(OSLEnv *env, const OSLFile *oslfile,
+			uint64_t offset, size_t n, char *scratch, OSLIOClass io_class)
+	{
+		typedef OSLBlockGeometry<BlockPages> Geometry;
+
+		OSLIOGrant grant(env->GetIOScheduler(), env->GetIOTenant(),
+				io_class, false);
+		Transport *transport = static_cast<Transport *>(env->GetTransport());
+		char *page = env->BounceBuffer();
+		const size_t block = Geometry::Size(oslfile);
+		uint64_t end = offset + n;
+		char *dst = scratch;
+
+		if (page == NULL || n == 0)
+		{
+			return page ? Status::OK()
+				: Status::IOError("OSL bounce buffer allocation failed");
+		}
+
+		const size_t first_idx = offset / block;
+		const size_t end_idx = (end - 1) / block + 1;
+		std::vector<OSLBlockRef> blocks;
+		env->SnapshotBlocks(oslfile, first_idx, end_idx, &blocks);
+		if (blocks.size() != end_idx - first_idx)
+		{
+			return Status::IOError("OSL read past mapped pages", oslfile->name);
+		}
+
+		int retries = 0;
+		while (offset < end)
+		{
+			size_t idx = offset / block;
+			size_t in_page = offset % block;
+			size_t len = std::min<uint64_t>(block - in_page, end - offset);
+			OSLBlockRef &ref = blocks[idx - first_idx];
+
+			if (in_page + len > ref.valid)
 			{
-				printf("Systemcall successfull\n");
+				return Status::IOError("OSL read past synced data", oslfile->name);
 			}
-			else
+
+			Cache::Handle *cached = env->LookupPage(oslfile, idx);
+			const char *src = cached ? env->PageData(cached) : page;
+
+			if (!cached)
 			{
-				printf("Error systemcall\n");
+				grant.Page(end - offset, block);
+				Status s = SubmitPages(transport, READ, ref.lba, page,
+						Geometry::Pages(oslfile));
+				if (!s.ok())
+				{
+					return s;
+				}
 			}
-			parameters.data_pointer = scratch + 4096;
+
+			uint32_t crc = crc32c::Extend(0, src, in_page);
+			crc = CopyAndExtendCRC32C(dst, src + in_page, len, crc);
+			crc = crc32c::Extend(crc, src + in_page + len, ref.valid - in_page - len);
+
+			if (cached)
+			{
+				env->ReleasePage(cached);
+			}
+
+			if (crc != ref.crc)
+			{
+				std::vector<OSLBlockRef> now;
+				env->SnapshotBlocks(oslfile, idx, idx + 1, &now);
+				if (retries < 2 && now.size() == 1 && (now[0].crc != ref.crc ||
+							now[0].valid != ref.valid || now[0].lba != ref.lba))
+				{
+					ref = now[0];
+					retries++;
+					continue;
+				}
+
+				std::cout << __func__ << " file: " << oslfile->name
+					<< " checksum mismatch on page " << idx << std::endl;
+				return Status::Corruption("OSL page checksum mismatch", oslfile->name);
+			}
+
+			dst += len;
+			offset += len;
 		}
 
-		*readLen = n;
-		*result = Slice(scratch + offset, n);
 		return Status::OK();
 	}
 
-	Status OSLSequentialFile::Read(size_t n, Slice *result, char *scratch)
+	/* Large reads go out as OSL_SCHED_CHUNK pieces on the submission queues;
+	 * *readLen is n on success and 0 otherwise. */
+	static Status ReadVerifiedRange(OSLEnv *env, const OSLFile *oslfile,
+			uint64_t offset, size_t n, char *scratch, size_t *readLen,
+			OSLIOClass io_class)
 	{
+		Status s = Status::TryAgain();
+
+		/* A promoted file is read from its local copy; the migrator waits
+		 * for reads in flight before dropping it. */
+		std::shared_lock<std::shared_mutex> tier_lock(oslfile->tier_mutex);
+		if (oslfile->local)
+		{
+			Slice result;
+			s = oslfile->local->Read(offset, n, &result, scratch);
+			if (s.ok() && result.size() != n)
+			{
+				s = Status::IOError("OSL short read from tier copy", oslfile->local_path);
+			}
+			if (s.ok() && result.data() != scratch)
+			{
+				memcpy(scratch, result.data(), n);
+			}
+
+			*readLen = s.ok() ? n : 0;
+			return s;
+		}
+
+		if (oslfile->packed)
+		{
+			s = env->ReadPacked(oslfile, offset, n, scratch);
+		}
+
+		/* Not packed, or turned into pages since the check above. Chunks
+		 * are whole blocks, so no block is read twice. */
+		if (s.IsTryAgain())
+		{
+			OSLIOEngine::ReadFn read = env->GetIOEngine()->Read(oslfile);
+			s = env->SubmitChunked(offset, n, io_class,
+					[&](uint64_t off, size_t len) {
+					return read(env, oslfile, off, len, scratch + (off - offset),
+							io_class);
+					},
+					std::max<size_t>(OSL_SCHED_CHUNK, oslfile->BlockSize()));
+		}
+
+		*readLen = s.ok() ? n : 0;
+		return s;
+	}
+
+	/* Writes blocks [first_page, first_page + npages) of oslfile from buf. */
+	template <typename Transport, std::uint32_t BlockPages>
+	static Status WritePages(OSLEnv *env, const OSLFile *oslfile,
+			size_t first_page, size_t npages, const char *buf, OSLIOClass io_class)
+	{
+		typedef OSLBlockGeometry<BlockPages> Geometry;
+
+		OSLIOGrant grant(env->GetIOScheduler(), env->GetIOTenant(),
+				io_class, true);
+		Transport *transport = static_cast<Transport *>(env->GetTransport());
+		const size_t block = Geometry::Size(oslfile);
+
+		for (size_t i = 0; i < npages; i++)
+		{
+			grant.Page((npages - i) * block, block);
+			Status s = SubmitPages(transport, WRITE, oslfile->lbas[first_page + i],
+					(char *)buf + i * block, Geometry::Pages(oslfile));
+			if (!s.ok())
+			{
+				std::cout << __func__ << " file: " << oslfile->name
+					<< " (write) error on page " << first_page + i << std::endl;
+				return s;
+			}
+		}
+
+		return Status::OK();
+	}
+
+	/* The env id and uuididx both persist with the namespace, so writer and
+	 * readers of a file agree on its ID, across restarts too, and uuididx is
+	 * never reused within an env. Returning 0 lets RocksDB pick its own. */
+	static size_t EncodeUniqueId(const OSLEnv *env, const OSLFile *oslfile,
+			char *id, size_t max_size)
+	{
+		if (oslfile == NULL || max_size < kMaxVarint64Length * 2)
+		{
+			return 0;
+		}
+
+		char *rid = EncodeVarint64(id, env->GetEnvId());
+		rid = EncodeVarint64(rid, oslfile->uuididx);
+
+		return static_cast<size_t>(rid - id);
+	}
+
+	/* Only transports whose type is known here get engines of their own;
+	 * any other one goes through the virtual Submit. */
+	template <typename Transport>
+	static const OSLIOEngine *IOEngineFor()
+	{
+		static const OSLIOEngine engine = {
+			&ReadVerifiedPages<Transport, 1>,
+			&WritePages<Transport, 1>,
+			&ReadVerifiedPages<Transport, 0>,
+			&WritePages<Transport, 0>,
+		};
+		return &engine;
+	}
+
+	const OSLIOEngine *OSLIOEngine::Select(OSLTransport *transport)
+	{
+		if (dynamic_cast<OSLSyscallTransport *>(transport) != NULL)
+		{
+			return IOEngineFor<OSLSyscallTransport>();
+		}
+		return IOEngineFor<OSLTransport>();
+	}
+
+	/* ### Device access ### */
+
+	Status OSLEnv::SubmitLBA(char command, uint32_t lba, char *buf, uint32_t npages)
+	{
+		return SubmitPages(GetTransport(), command, lba, buf, npages);
+	}
+
+	Status OSLEnv::ReadFileRange(const OSLFile *oslfile, uint64_t offset, size_t n,
+			char *scratch)
+	{
+		size_t readLen = 0;
+		return ReadVerifiedRange(this, oslfile, offset, n, scratch, &readLen,
+				OSLIOScheduler::ThreadReadClass());
+	}
+
+	/* ### SequentialFile method implementation ### */
+
+	/* Copies [offset, offset + n) out of the readahead windows, moving the
+	 * window forward as the copy runs past it. */
+	Status OSLSequentialFile::ReadOffset(uint64_t offset, size_t n, Slice *result,
+			char *scratch)
+	{
+		if (oslfile == NULL || offset >= oslfile->synced_size)
+		{
+			*result = Slice(scratch, 0);
+			return Status::OK();
+		}
+
+		if (offset + n > oslfile->synced_size)
+		{
+			n = oslfile->synced_size - offset;
+		}
+
+		size_t copied = 0;
+		while (copied < n)
+		{
+			uint64_t pos = offset + copied;
+
+			if (pos >= ra_off && pos < ra_off + ra_len)
+			{
+				size_t len = std::min<uint64_t>(n - copied, ra_off + ra_len - pos);
+				memcpy(scratch + copied, ra_buf + (pos - ra_off), len);
+				copied += len;
+				continue;
+			}
+
+			Status s = FillWindow(pos);
+			if (s.IsNotSupported())
+			{
+				/* No buffers for readahead: read straight into scratch. */
+				size_t readLen = 0;
+				s = ReadVerifiedRange(env_osl, oslfile, pos, n - copied,
+						scratch + copied, &readLen, OSLIOScheduler::ThreadReadClass());
+				copied += readLen;
+			}
+			if (!s.ok())
+			{
+				*result = Slice(scratch, 0);
+				return s;
+			}
+		}
+
+		*result = Slice(scratch, n);
+		return Status::OK();
+	}
+
+	/* Makes the window starting at offset current, from the prefetched one
+	 * when it holds offset and by a synchronous read otherwise. */
+	Status OSLSequentialFile::FillWindow(uint64_t offset)
+	{
+		if (!ra_buf)
+		{
+			ra_buf = env_osl->AllocIOBuffer(OSL_READAHEAD_MAX);
+		}
+		if (!ra_next_buf)
+		{
+			ra_next_buf = env_osl->AllocIOBuffer(OSL_READAHEAD_MAX);
+		}
+		if (!ra_buf || !ra_next_buf)
+		{
+			return Status::NotSupported("OSL readahead buffer allocation failed");
+		}
+
+		bool sequential = offset == ra_off + ra_len;
+		ra_len = 0;
+
+		if (ra_pending.valid())
+		{
+			/* A failed readahead is only reported if the read it was for
+			 * fails too. */
+			Status s = ra_pending.get();
+			if (s.ok() && offset >= ra_next_off && offset < ra_next_off + ra_next_len)
+			{
+				std::swap(ra_buf, ra_next_buf);
+				ra_off = ra_next_off;
+				ra_len = ra_next_len;
+				ra_window = std::min<size_t>(ra_window * 2, OSL_READAHEAD_MAX);
+				StartReadahead(ra_off + ra_len);
+				return Status::OK();
+			}
+		}
+
+		if (!sequential)
+		{
+			ra_window = OSL_READAHEAD_MIN;
+		}
+
+		size_t len = std::min<uint64_t>(ra_window, oslfile->synced_size - offset);
 		size_t readLen = 0;
-		Status status = ReadOffset(read_off, n, result, scratch, &readLen);
+		Status s = ReadVerifiedRange(env_osl, oslfile, offset, len, ra_buf, &readLen,
+				OSLIOScheduler::ThreadReadClass());
+		if (!s.ok())
+		{
+			return s;
+		}
+
+		ra_off = offset;
+		ra_len = len;
+		StartReadahead(ra_off + ra_len);
+		return Status::OK();
+	}
+
+	/* Fetches the next window into ra_next_buf while the caller works
+	 * through the current one. */
+	void OSLSequentialFile::StartReadahead(uint64_t offset)
+	{
+		if (offset >= oslfile->synced_size)
+		{
+			return;
+		}
+
+		OSLIOClass io_class = OSLIOScheduler::ThreadReadClass();
+		size_t len = std::min<uint64_t>(ra_window, oslfile->synced_size - offset);
+
+		ra_next_off = offset;
+		ra_next_len = len;
+		ra_pending = env_osl->SubmitReadahead([this, offset, len, io_class]() {
+				size_t readLen = 0;
+				return ReadVerifiedRange(env_osl, oslfile, offset, len, ra_next_buf,
+						&readLen, io_class);
+				});
+	}
+
+	Status OSLSequentialFile::Read(size_t n, Slice *result, char *scratch)
+	{
+		Status status = ReadOffset(read_off, n, result, scratch);
 
 		if (status.ok())
-			read_off += readLen;
+			read_off += result->size();
 
 		return status;
 	}
@@ -69,12 +526,7 @@ namespace rocksdb
 	Status OSLSequentialFile::PositionedRead(uint64_t offset, size_t n,
 			Slice *result, char *scratch)
 	{
-		size_t readLen = 0;
-		Status status = ReadOffset(read_off, n, result, scratch, &readLen);
-
-		*result = Slice(scratch, readLen);
-
-		return Status::OK();
+		return ReadOffset(offset, n, result, scratch);
 	}
 
 	Status OSLSequentialFile::Skip(uint64_t n)
@@ -96,43 +548,30 @@ namespace rocksdb
 	Status OSLRandomAccessFile::ReadOffset(uint64_t offset, size_t n, Slice *result,
 			char *scratch) const
 	{
-		struct zrocks_map *map;
-		size_t piece_off = 0, left, msize;
-		int ret;
-		unsigned i;
-		uint64_t off;
+		size_t readLen = 0;
 
-		if (oslfile == NULL || offset >= oslfile->size)
+		if (oslfile == NULL || offset >= oslfile->synced_size)
 		{
+			*result = Slice(scratch, 0);
 			return Status::OK();
 		}
 
-		if (offset + n > oslfile->size)
+		if (offset + n > oslfile->synced_size)
 		{
-			n = oslfile->size - offset;
+			n = oslfile->synced_size - offset;
 		}
 
-		struct csd_params parameters;
-
-		parameters.buffer1.command[0] = 'd';
-		parameters.data_pointer = scratch;
-
-		for (auto it = oslfile->lbas.begin(); it != oslfile->lbas.end(); it++)
+		/* Background reads would drown the profile of what users touch. */
+		if (OSLIOScheduler::ThreadReadClass() == OSL_IO_USER_READ)
 		{
-			parameters.lba = *it;
-			if (!syscall(__NR_csd_syscall, (void *)&parameters))
-			{
-				printf("Systemcall successfull\n");
-			}
-			else
-			{
-				printf("Error systemcall\n");
-			}
-			parameters.data_pointer = scratch + 4096;
+			oslfile->RecordRead(offset, n);
 		}
 
-		*result = Slice(scratch + offset, n);
-		return Status::OK();
+		Status s = ReadVerifiedRange(env_osl, oslfile, offset, n, scratch, &readLen,
+				OSLIOScheduler::ThreadReadClass());
+
+		*result = Slice(scratch, readLen);
+		return s;
 	}
 
 	Status OSLRandomAccessFile::ReadObj(uint64_t offset, size_t n, Slice *result,
@@ -147,46 +586,26 @@ namespace rocksdb
 		return ReadOffset(offset, n, result, scratch);
 	}
 
+	/* Without a page cache there is nowhere to prefetch to; NotSupported
+	 * makes RocksDB fall back to its own readahead buffer. */
 	Status OSLRandomAccessFile::Prefetch(uint64_t offset, size_t n)
 	{
-
-		if (env_osl->files[filename_] == NULL)
+		if (oslfile == NULL)
 		{
 			return Status::OK();
 		}
 
-		return Status::OK();
-	}
-
-	size_t OSLRandomAccessFile::GetUniqueId(char *id, size_t max_size) const
-	{
-		if (max_size < (kMaxVarint64Length * 3))
-		{
-			return 0;
-		}
-
-		char *rid = id;
-		uint64_t base = 0;
-		OSLFile *oslFilePtr = NULL;
-
-		oslFilePtr = env_osl->files[filename_];
-
-		if (!oslFilePtr)
-		{
-			std::cout << "the osl random file ptr is null"
-				<< "file name is " << filename_ << std::endl;
-			base = (uint64_t)this;
-		}
-		else
+		if (!env_osl->HasPageCache())
 		{
-			base = ((uint64_t)env_osl->files[filename_]->uuididx);
+			return Status::NotSupported("OSL page cache is disabled");
 		}
 
-		rid = EncodeVarint64(rid, (uint64_t)oslFilePtr);
-		rid = EncodeVarint64(rid, base);
-		assert(rid >= id);
+		return env_osl->PrefetchPages(oslfile, offset, n);
+	}
 
-		return static_cast<size_t>(rid - id);
+	size_t OSLRandomAccessFile::GetUniqueId(char *id, size_t max_size) const
+	{
+		return EncodeUniqueId(env_osl, oslfile, id, max_size);
 	}
 
 	Status OSLRandomAccessFile::InvalidateCache(size_t offset, size_t length)
@@ -195,22 +614,84 @@ namespace rocksdb
 	}
 
 	/* ### WritableFile method implementation ### */
-	Status OSLWritableFile::Append(const rocksdb::Slice &,
-			const rocksdb::DataVerificationInfo &)
+
+	/* Copies src into the write cache, flushing it whenever it fills up. The
+	 * per-page CRCs are maintained in the same pass; if crc is not NULL it is
+	 * extended with the CRC32C of all of src. */
+	Status OSLWritableFile::CopyToCache(const char *src, size_t n, uint32_t *crc)
 	{
+		while (n > 0)
+		{
+			size_t used = (size_t)(cache_off - write_cache);
+
+			if (used == cache_cap)
+			{
+				Status s = cache_cap < OSL_MAX_BUF ? GrowCache() : Sync();
+				if (!s.ok())
+				{
+					return s;
+				}
+				continue;
+			}
+
+			size_t page = used / block_size_;
+			size_t in_page = used % block_size_;
+			size_t len = std::min(n, block_size_ - in_page);
+			uint32_t seg = CopyAndExtendCRC32C(cache_off, src, len, 0);
+
+			if (in_page == 0)
+			{
+				cache_crcs[page] = 0;
+			}
+			cache_crcs[page] = crc32c::Crc32cCombine(cache_crcs[page], seg, len);
+			if (crc)
+			{
+				*crc = crc32c::Crc32cCombine(*crc, seg, len);
+			}
+
+			cache_off += len;
+			src += len;
+			n -= len;
+		}
+
 		return Status::OK();
 	}
 
-	Status OSLWritableFile::PositionedAppend(const rocksdb::Slice &, uint64_t,
-			const rocksdb::DataVerificationInfo &)
+	/* Doubles the write cache; the cached bytes and block CRCs move along. */
+	Status OSLWritableFile::GrowCache()
 	{
+		size_t used = (size_t)(cache_off - write_cache);
+		size_t cap = std::min<size_t>(cache_cap * 2, OSL_MAX_BUF);
+		char *buf = env_osl->AllocIOBuffer(cap);
+
+		if (!buf)
+		{
+			return Status::IOError("OSL write cache allocation failed", filename_);
+		}
+
+		memcpy(buf, write_cache, used);
+		env_osl->FreeIOBuffer(write_cache, cache_cap);
+
+		write_cache = buf;
+		cache_off = buf + used;
+		cache_cap = cap;
+		cache_crcs.resize(cap / block_size_, 0);
+
 		return Status::OK();
 	}
-	Status OSLWritableFile::Append(const Slice &data)
+
+	Status OSLWritableFile::Append(const rocksdb::Slice &data,
+			const rocksdb::DataVerificationInfo &verification_info)
 	{
-		size_t size = data.size();
-		size_t offset = 0;
-		Status s;
+		if (verification_info.checksum.size() != sizeof(uint32_t))
+		{
+			return Append(data);
+		}
+
+		if (data.empty())
+		{
+			return Status::OK();
+		}
 
 		if (!cache_off)
 		{
@@ -218,40 +699,81 @@ namespace rocksdb
 			return Status::IOError();
 		}
 
-		size_t cpytobuf_size = OSL_MAX_BUF;
-		if (cache_off + data.size() > write_cache + OSL_MAX_BUF)
+		uint32_t expected = DecodeFixed32(verification_info.checksum.data());
+		uint32_t crc = 0;
+		size_t used = (size_t)(cache_off - write_cache);
+
+		if (used + data.size() > OSL_MAX_BUF)
 		{
+			/* The copy would flush part of data before the whole of it has
+			 * been checksummed, so verify up front in this (rare) case. */
+			if (crc32c::Value(data.data(), data.size()) != expected)
+			{
+				return Status::Corruption("OSL append checksum mismatch", filename_);
+			}
+			return Append(data);
+		}
 
-			size = cpytobuf_size - (cache_off - write_cache);
-			memcpy(cache_off, data.data(), size);
-			cache_off += size;
-			s = Sync();
+		/* A full cache has no CRC slot at used; data fits below OSL_MAX_BUF,
+		 * so growing is enough to give it one. */
+		if (used == cache_cap)
+		{
+			Status s = GrowCache();
 			if (!s.ok())
 			{
-				return Status::IOError();
+				return s;
 			}
+		}
 
-			offset = size;
-			size = data.size() - size;
+		uint32_t saved_crc = cache_crcs[used / block_size_];
+		Status s = CopyToCache(data.data(), data.size(), &crc);
+		if (!s.ok())
+		{
+			return s;
+		}
 
-			while (size > cpytobuf_size)
-			{
-				memcpy(cache_off, data.data() + offset, cpytobuf_size);
-				offset = offset + cpytobuf_size;
-				size = size - cpytobuf_size;
-				cache_off += cpytobuf_size;
-				s = Sync();
-				if (!s.ok())
-				{
-					return Status::IOError();
-				}
-			}
+		if (crc != expected)
+		{
+			cache_off = write_cache + used;
+			cache_crcs[used / block_size_] = saved_crc;
+			std::cout << __func__ << " file: " << filename_
+				<< " checksum mismatch, dropping " << data.size() << " bytes" << std::endl;
+			return Status::Corruption("OSL append checksum mismatch", filename_);
 		}
 
-		memcpy(cache_off, data.data() + offset, size);
-		cache_off += size;
 		filesize_ += data.size();
+		oslfile->size += data.size();
+
+		return Status::OK();
+	}
 
+	Status OSLWritableFile::PositionedAppend(const rocksdb::Slice &data,
+			uint64_t offset, const rocksdb::DataVerificationInfo &verification_info)
+	{
+		if (offset != filesize_)
+		{
+			std::cout << "Write Violation: " << __func__ << " size: " << data.size()
+				<< " offset: " << offset << std::endl;
+		}
+
+		return Append(data, verification_info);
+	}
+
+	Status OSLWritableFile::Append(const Slice &data)
+	{
+		if (!cache_off)
+		{
+			std::cout << __func__ << filename_ << " failed : cache is NULL." << std::endl;
+			return Status::IOError();
+		}
+
+		Status s = CopyToCache(data.data(), data.size(), NULL);
+		if (!s.ok())
+		{
+			return s;
+		}
+
+		filesize_ += data.size();
 		oslfile->size += data.size();
 
 		return Status::OK();
@@ -271,7 +793,7 @@ namespace rocksdb
 
 	Status OSLWritableFile::Truncate(uint64_t size)
 	{
-		if (env_osl->files[filename_] == NULL)
+		if (oslfile == NULL)
 		{
 			return Status::OK();
 		}
@@ -288,6 +810,40 @@ namespace rocksdb
 		filesize_ = size;
 		oslfile->size = size;
 
+		/* The new last block only holds a prefix of what was checksummed. */
+		size_t used = (size_t)(cache_off - write_cache);
+		size_t page = used / block_size_;
+		if (used % block_size_)
+		{
+			cache_crcs[page] = crc32c::Value(write_cache + page * block_size_,
+					used % block_size_);
+		}
+
+		std::lock_guard<std::mutex> lock(env_osl->files_mutex);
+		oslfile->modification_time = env_osl->NowSeconds();
+		if (synced_size_ > size)
+		{
+			synced_size_ = OSL_UNSYNCED;
+		}
+		if (oslfile->synced_size > size)
+		{
+			/* The block holding the new end will be rewritten in place. */
+			env_osl->ErasePages(oslfile, size / block_size_);
+			oslfile->synced_size = size;
+			if (size % block_size_ && !oslfile->packed)
+			{
+				oslfile->page_crcs[size / block_size_] = cache_crcs[page];
+			}
+			if (oslfile->packed)
+			{
+				env_osl->LogPacked(oslfile);
+			}
+			else
+			{
+				env_osl->LogExtent(oslfile, size / block_size_);
+			}
+		}
+
 		return Status::OK();
 	}
 
@@ -304,10 +860,7 @@ namespace rocksdb
 
 	Status OSLWritableFile::Sync()
 	{
-
-		uint16_t pieces = 0;
 		size_t size;
-		int ret, i;
 
 		if (!cache_off)
 			return Status::OK();
@@ -316,33 +869,187 @@ namespace rocksdb
 		if (!size)
 			return Status::OK();
 
-		struct csd_params parameters;
-		parameters.buffer1.command[0] = WRITE;
+		/* Nothing appended since the last Sync: packing again would only
+		 * leave another dead copy in the segment. */
+		if (cache_base + size == synced_size_)
+			return Status::OK();
 
-		for (uint32_t id = 0; id < size, id += 4096)
+		/* A small file is packed as a whole while it is small, and the
+		 * cache keeps all of it so it can be repacked, or written out as
+		 * pages once it outgrows the threshold. */
+		if (cache_base == 0 && size <= env_osl->PackThreshold() &&
+				GetIOClass() != OSL_IO_WAL)
 		{
-			lbas.push_back(oslfile->free_lbas.top());
-			parameters.lba = oslfile->free_lbas.top();
-			parameters.data_pointer = write_cache + id;
-			if (!syscall(__NR_csd_syscall, (void *)&parameters))
+			/* No room for a new segment: the file still fits in pages. */
+			Status s = SyncPacked(size);
+			if (s.ok())
 			{
-				printf("Systemcall successfull\n");
+				synced_size_ = size;
 			}
-			else
+			if (!s.IsNoSpace())
+			{
+				return s;
+			}
+		}
+
+		size_t first_page = cache_base / block_size_;
+		size_t end_page = first_page + (size + block_size_ - 1) / block_size_;
+
+		/* A partial last block from the previous Sync is rewritten in place
+		 * so that file offsets keep mapping to lbas[off / block]; only the
+		 * blocks beyond it need new LBAs. */
+		if (end_page > oslfile->lbas.size())
+		{
+			std::vector<uint32_t> lbas;
+			Status s = env_osl->AllocateLBAs(end_page - oslfile->lbas.size(), &lbas,
+					oslfile->block_pages);
+			if (!s.ok())
 			{
-				printf("Error systemcall\n");
 				std::cout << __func__ << " file: " << filename_
-					<< " ZRocks (write) error: " << ret << std::endl;
-				return Status::IOError();
+					<< " no free lbas left." << std::endl;
+				return s;
+			}
+
+			std::lock_guard<std::mutex> lock(env_osl->files_mutex);
+			oslfile->lbas.insert(oslfile->lbas.end(), lbas.begin(), lbas.end());
+			oslfile->page_crcs.resize(oslfile->lbas.size(), 0);
+		}
+
+		OSLIOClass io_class = GetIOClass();
+		OSLIOEngine::WriteFn write = env_osl->GetIOEngine()->Write(oslfile);
+		Status s = env_osl->SubmitChunked(cache_base, size, io_class,
+				[&](uint64_t off, size_t len) {
+				return write(env_osl, oslfile, off / block_size_,
+						(len + block_size_ - 1) / block_size_,
+						write_cache + (off - cache_base), io_class);
+				},
+				std::max<size_t>(OSL_SCHED_CHUNK, block_size_));
+		if (!s.ok())
+		{
+			return s;
+		}
+
+		bool was_packed;
+		std::uint32_t old_segment;
+		std::uint32_t old_length;
+		{
+			/* Publish the new pages to the namespace all at once. */
+			std::lock_guard<std::mutex> lock(env_osl->files_mutex);
+			was_packed = oslfile->packed;
+			old_segment = oslfile->pack_segment;
+			old_length = oslfile->pack_length;
+			oslfile->packed = false;
+			for (size_t id = 0; id < size; id += block_size_)
+			{
+				oslfile->page_crcs[first_page + id / block_size_] =
+					cache_crcs[id / block_size_];
 			}
-			oslfile->free_lbas.pop();
+			oslfile->synced_size = cache_base + size;
+			oslfile->modification_time = env_osl->NowSeconds();
+			env_osl->LogExtent(oslfile, first_page);
+		}
+
+		/* The old extent is only given up once the log no longer needs it. */
+		s = env_osl->SyncLog();
+		if (!s.ok())
+		{
+			return s;
+		}
+		if (was_packed)
+		{
+			env_osl->ReleasePacked(old_segment, old_length);
 		}
 
+		/* Keep the unfinished last block cached so the next Sync can
+		 * complete it; its CRC moves to slot 0 with it. */
+		size_t tail = size % block_size_;
+		size_t full = size - tail;
+		if (tail)
+		{
+			memmove(write_cache, write_cache + full, tail);
+			cache_crcs[0] = cache_crcs[full / block_size_];
+		}
 
-		cache_off = write_cache;
+		synced_size_ = cache_base + size;
+		cache_base += full;
+		cache_off = write_cache + tail;
 		return Status::OK();
 	}
 
+	/* WAL appends gate commits and go first; otherwise the priority RocksDB
+	 * set on the file decides, then the pool of the writing thread. */
+	OSLIOClass OSLWritableFile::GetIOClass()
+	{
+		const std::string wal_suffix = ".log";
+
+		if (filename_.size() >= wal_suffix.size() &&
+				filename_.compare(filename_.size() - wal_suffix.size(),
+					wal_suffix.size(), wal_suffix) == 0)
+		{
+			return OSL_IO_WAL;
+		}
+
+		switch (GetIOPriority())
+		{
+			case Env::IO_LOW:
+				return OSL_IO_COMPACTION;
+			case Env::IO_HIGH:
+				return OSL_IO_FLUSH;
+			case Env::IO_USER:
+				return OSL_IO_USER_READ;
+			default:
+				return OSLIOScheduler::ThreadWriteClass();
+		}
+	}
+
+	Status OSLWritableFile::SyncPacked(size_t size)
+	{
+		std::uint32_t segment;
+		std::uint64_t offset;
+		uint32_t crc = crc32c::Value(write_cache, size);
+
+		Status s = env_osl->PackBytes(write_cache, size, GetIOClass(), &segment,
+				&offset);
+		if (!s.ok())
+		{
+			return s;
+		}
+
+		bool was_packed;
+		std::uint32_t old_segment;
+		std::uint32_t old_length;
+		std::vector<uint32_t> old_lbas;
+		{
+			std::lock_guard<std::mutex> lock(env_osl->files_mutex);
+			was_packed = oslfile->packed;
+			old_segment = oslfile->pack_segment;
+			old_length = oslfile->pack_length;
+
+			/* Pages from an earlier unpacked Sync are superseded. */
+			env_osl->ErasePages(oslfile, 0);
+			old_lbas.swap(oslfile->lbas);
+			oslfile->page_crcs.clear();
+
+			oslfile->packed = true;
+			oslfile->pack_segment = segment;
+			oslfile->pack_offset = offset;
+			oslfile->pack_length = size;
+			oslfile->pack_crc = crc;
+			oslfile->synced_size = size;
+			oslfile->modification_time = env_osl->NowSeconds();
+			env_osl->LogPacked(oslfile);
+		}
+
+		s = env_osl->SyncLog();
+		if (was_packed)
+		{
+			env_osl->ReleasePacked(old_segment, old_length);
+		}
+		env_osl->FreeLBAs(old_lbas, oslfile->block_pages);
+
+		return s;
+	}
+
 	Status OSLWritableFile::Fsync()
 	{
 		return Sync();
@@ -356,6 +1063,8 @@ namespace rocksdb
 	void OSLWritableFile::SetWriteLifeTimeHint(Env::WriteLifeTimeHint hint)
 	{
 		write_hint_ = hint;
+
+		std::lock_guard<std::mutex> lock(oslfile->heat_mutex);
 		oslfile->level = hint - Env::WLTH_SHORT;
 	}
 
@@ -366,27 +1075,7 @@ namespace rocksdb
 
 	size_t OSLWritableFile::GetUniqueId(char *id, size_t max_size) const
 	{
-		if (max_size < (kMaxVarint64Length * 3))
-		{
-			return 0;
-		}
-
-		char *rid = id;
-		uint64_t base = 0;
-		if (!env_osl->files[filename_])
-		{
-			base = (uint64_t)this;
-		}
-		else
-		{
-			base = ((uint64_t)oslfile->uuididx);
-		}
-		rid = EncodeVarint64(rid, (uint64_t)base);
-		rid = EncodeVarint64(rid, (uint64_t)base);
-		rid = EncodeVarint64(rid, (uint64_t)base);
-		assert(rid >= id);
-
-		return static_cast<size_t>(rid - id);
+		return EncodeUniqueId(env_osl, oslfile, id, max_size);
 	}
 
 } // namespace rocksdb
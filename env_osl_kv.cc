@@ -0,0 +1,227 @@
+#include <errno.h>
+#include <string.h>
+
+#include <iostream>
+
+#include "env_osl.h"
+
+namespace rocksdb
+{
+
+	static Status CheckKVKey(const Slice &key)
+	{
+		if (key.empty() || key.size() > MAX_KV_KEY_SIZE)
+		{
+			return Status::InvalidArgument("OSL key must be 1 to 16 bytes");
+		}
+		return Status::OK();
+	}
+
+	static void FillKVObject(struct csd_kv_object *object, const Slice &key,
+			char *value, size_t value_len)
+	{
+		memset(object->key, 0, sizeof(object->key));
+		memcpy(object->key, key.data(), key.size());
+		object->key_len = key.size();
+		object->value = value;
+		object->value_len = value_len;
+		object->status = 0;
+	}
+
+	static Status KVObjectStatus(const struct csd_kv_object &object)
+	{
+		if (object.status == 0)
+		{
+			return Status::OK();
+		}
+		if (object.status == -ENOENT)
+		{
+			return Status::NotFound();
+		}
+		return Status::IOError("OSL object command failed");
+	}
+
+	Status OSLEnv::SubmitKV(char command, struct csd_kv_object *objects, int count)
+	{
+		struct csd_params parameters;
+		size_t bytes = 0;
+
+		/* Device objects carry no tenant: on a shared device every tenant,
+		 * and every later one, would see and overwrite the same keys, and
+		 * MAX_KV_KEY_SIZE leaves no room to scope them. */
+		if (!env_options.tenant.empty())
+		{
+			return Status::NotSupported("OSL key-value passthrough is not available to tenants of a shared device");
+		}
+
+		for (int i = 0; i < count; i++)
+		{
+			bytes += objects[i].key_len + objects[i].value_len;
+		}
+
+		/* Object commands are foreground point operations: reads compete
+		 * with user reads, writes with the WAL. */
+		OSLIOScheduler *sched = GetIOScheduler();
+		sched->Acquire(GetIOTenant(),
+				command == GETOBJECT ? OSL_IO_USER_READ : OSL_IO_WAL,
+				bytes, command != GETOBJECT);
+
+		parameters.ObjectID = count;
+		parameters.lba = 0;
+		parameters.data_pointer = (char *)objects;
+		parameters.buffer1.command[0] = command;
+
+		long ret = GetTransport()->Submit(&parameters);
+		sched->Release();
+
+		if (ret)
+		{
+			std::cout << __func__ << " command: " << command << " objects: " << count
+				<< " error: " << errno << std::endl;
+			return Status::IOError("OSL device command failed");
+		}
+
+		return Status::OK();
+	}
+
+	Status OSLEnv::KVPut(const Slice &key, const Slice &value)
+	{
+		OSLKVWriteBatch batch;
+		batch.Put(key, value);
+		return KVWrite(batch);
+	}
+
+	Status OSLEnv::KVDelete(const Slice &key)
+	{
+		OSLKVWriteBatch batch;
+		batch.Delete(key);
+		return KVWrite(batch);
+	}
+
+	Status OSLEnv::KVGet(const Slice &key, std::string *value)
+	{
+		std::vector<std::string> values;
+		std::vector<Status> statuses = KVMultiGet(std::vector<Slice>(1, key), &values);
+
+		if (statuses[0].ok())
+		{
+			value->swap(values[0]);
+		}
+		return statuses[0];
+	}
+
+	std::vector<Status> OSLEnv::KVMultiGet(const std::vector<Slice> &keys,
+			std::vector<std::string> *values)
+	{
+		std::vector<Status> statuses(keys.size());
+		struct csd_kv_object objects[MAX_KV_BATCH];
+		size_t index[MAX_KV_BATCH];
+
+		values->clear();
+		values->resize(keys.size());
+
+		for (size_t start = 0; start < keys.size(); start += MAX_KV_BATCH)
+		{
+			size_t end = std::min(keys.size(), start + MAX_KV_BATCH);
+			int count = 0;
+
+			for (size_t i = start; i < end; i++)
+			{
+				statuses[i] = CheckKVKey(keys[i]);
+				if (!statuses[i].ok())
+				{
+					continue;
+				}
+
+				/* The device fills the value in place, no bounce copy. */
+				(*values)[i].resize(MAX_KV_VALUE_SIZE);
+				FillKVObject(&objects[count], keys[i], &(*values)[i][0],
+						MAX_KV_VALUE_SIZE);
+				index[count++] = i;
+			}
+
+			if (count == 0)
+			{
+				continue;
+			}
+
+			Status s = SubmitKV(GETOBJECT, objects, count);
+
+			for (int j = 0; j < count; j++)
+			{
+				size_t i = index[j];
+
+				statuses[i] = s.ok() ? KVObjectStatus(objects[j]) : s;
+				if (statuses[i].ok())
+				{
+					(*values)[i].resize(objects[j].value_len);
+				}
+				else
+				{
+					(*values)[i].clear();
+				}
+			}
+		}
+
+		return statuses;
+	}
+
+	Status OSLEnv::KVWrite(const OSLKVWriteBatch &batch)
+	{
+		const std::vector<OSLKVWriteBatch::Op> &ops = batch.Ops();
+		struct csd_kv_object objects[MAX_KV_BATCH];
+
+		for (const OSLKVWriteBatch::Op &op : ops)
+		{
+			Status s = CheckKVKey(op.key);
+			if (!s.ok())
+			{
+				return s;
+			}
+			if (op.value.size() > MAX_KV_VALUE_SIZE)
+			{
+				return Status::InvalidArgument("OSL value larger than 4 KB");
+			}
+		}
+
+		/* Submit runs of the same command in order, so a put followed by a
+		 * delete of the same key keeps its meaning. */
+		size_t start = 0;
+		while (start < ops.size())
+		{
+			char command = ops[start].command;
+			int count = 0;
+
+			while (start + count < ops.size() && count < MAX_KV_BATCH &&
+					ops[start + count].command == command)
+			{
+				const OSLKVWriteBatch::Op &op = ops[start + count];
+				FillKVObject(&objects[count], op.key, (char *)op.value.data(),
+						op.value.size());
+				count++;
+			}
+
+			Status s = SubmitKV(command, objects, count);
+			if (!s.ok())
+			{
+				return s;
+			}
+
+			for (int j = 0; j < count; j++)
+			{
+				s = KVObjectStatus(objects[j]);
+
+				/* Deleting a missing key is not an error. */
+				if (!s.ok() && !(command == DELETEOBJECT && s.IsNotFound()))
+				{
+					return s;
+				}
+			}
+
+			start += count;
+		}
+
+		return Status::OK();
+	}
+
+} // namespace rocksdb
@@ -0,0 +1,299 @@
+#include <sched.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <set>
+#include <sstream>
+
+#include "env_osl.h"
+
+#ifndef MAP_HUGE_2MB
+#define MAP_HUGE_2MB (21 << 26)
+#endif
+
+#ifndef MPOL_PREFERRED
+#define MPOL_PREFERRED 1
+#endif
+
+namespace rocksdb
+{
+
+	static std::atomic<std::uint64_t> osl_env_instances(0);
+
+	static void UnmapIOBuffer(char *buf, size_t size)
+	{
+		size_t len = (size + OSL_HUGE_PAGE - 1) / OSL_HUGE_PAGE * OSL_HUGE_PAGE;
+
+		if (buf)
+		{
+			munmap(buf, len);
+		}
+	}
+
+	/* Bounce buffers of one env; closed once the env has freed them. */
+	struct OSLBounceSet
+	{
+		std::mutex mutex;
+		std::set<char *> buffers;
+		bool closed = false;
+	};
+
+	/* The calling thread's bounce buffer for each env instance it has used.
+	 * Entries of destroyed envs are dropped as new ones are added; the rest
+	 * are freed when the thread exits. */
+	class OSLThreadBounceBuffers
+	{
+		public:
+			struct Entry
+			{
+				std::weak_ptr<OSLBounceSet> set;
+				char *buf;
+			};
+
+			std::map<std::uint64_t, Entry> entries;
+
+			~OSLThreadBounceBuffers()
+			{
+				for (auto it = entries.begin(); it != entries.end(); it++)
+				{
+					Release(it->second);
+				}
+			}
+
+			static void Release(const Entry &entry)
+			{
+				std::shared_ptr<OSLBounceSet> set = entry.set.lock();
+				if (!set)
+				{
+					return;
+				}
+
+				std::lock_guard<std::mutex> lock(set->mutex);
+				if (!set->closed && set->buffers.erase(entry.buf))
+				{
+					UnmapIOBuffer(entry.buf, OSL_BOUNCE_BUF);
+				}
+			}
+	};
+
+	static thread_local OSLThreadBounceBuffers bounce_buffers;
+
+	static bool ReadSysfsInt(const std::string &path, int *value)
+	{
+		std::ifstream in(path);
+		return static_cast<bool>(in >> *value);
+	}
+
+	/* Parses a sysfs cpulist such as "0-15,32-47". */
+	static void ParseCpuList(const std::string &list, std::vector<int> *cpus)
+	{
+		std::stringstream ss(list);
+		std::string range;
+
+		while (std::getline(ss, range, ','))
+		{
+			int first = 0, last = 0;
+			if (sscanf(range.c_str(), "%d-%d", &first, &last) == 2)
+			{
+				for (int cpu = first; cpu <= last; cpu++)
+				{
+					cpus->push_back(cpu);
+				}
+			}
+			else if (sscanf(range.c_str(), "%d", &first) == 1)
+			{
+				cpus->push_back(first);
+			}
+		}
+	}
+
+	void OSLEnv::InitNumaNode()
+	{
+		instance_id = ++osl_env_instances;
+		bounce_set = std::make_shared<OSLBounceSet>();
+		numa_node = -1;
+
+		if (!env_options.numa_aware)
+		{
+			return;
+		}
+
+		if (env_options.numa_node >= 0)
+		{
+			numa_node = env_options.numa_node;
+		}
+		else
+		{
+			std::string base = dev_name.substr(dev_name.find_last_of('/') + 1);
+			const std::string candidates[] = {
+				"/sys/block/" + base + "/device/numa_node",
+				"/sys/block/" + base + "/device/device/numa_node",
+				"/sys/class/misc/" + base + "/device/numa_node",
+			};
+
+			for (const std::string &path : candidates)
+			{
+				int node = -1;
+				if (ReadSysfsInt(path, &node) && node >= 0)
+				{
+					numa_node = node;
+					break;
+				}
+			}
+		}
+
+		if (numa_node < 0)
+		{
+			std::cout << "OSL device " << dev_name
+				<< " has no NUMA affinity, using local allocation" << std::endl;
+			return;
+		}
+
+		std::ifstream in("/sys/devices/system/node/node" +
+				std::to_string(numa_node) + "/cpulist");
+		std::string list;
+		if (std::getline(in, list))
+		{
+			ParseCpuList(list, &numa_cpus);
+		}
+
+		std::cout << "OSL device " << dev_name << " on NUMA node " << numa_node
+			<< " (" << numa_cpus.size() << " cpus)" << std::endl;
+	}
+
+	char *OSLEnv::AllocIOBuffer(size_t size)
+	{
+		size_t len = (size + OSL_HUGE_PAGE - 1) / OSL_HUGE_PAGE * OSL_HUGE_PAGE;
+		void *buf = MAP_FAILED;
+
+		if (env_options.use_huge_pages)
+		{
+			buf = mmap(NULL, len, PROT_READ | PROT_WRITE,
+					MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_HUGE_2MB, -1, 0);
+		}
+
+		if (buf == MAP_FAILED)
+		{
+			buf = mmap(NULL, len, PROT_READ | PROT_WRITE,
+					MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+			if (buf == MAP_FAILED)
+			{
+				std::cout << __func__ << " mmap of " << len << " bytes failed: "
+					<< errno << std::endl;
+				return NULL;
+			}
+			if (env_options.use_huge_pages)
+			{
+				madvise(buf, len, MADV_HUGEPAGE);
+			}
+		}
+
+		/* Pages are not faulted in yet, so the policy decides where they land.
+		 * Preferred rather than bind: a full node degrades to remote memory
+		 * instead of failing the write. */
+		if (numa_node >= 0)
+		{
+			unsigned long nodemask[4] = {0};
+			const unsigned long bits = sizeof(unsigned long) * 8;
+
+			if ((size_t)numa_node < sizeof(nodemask) * 8)
+			{
+				nodemask[numa_node / bits] |= 1UL << (numa_node % bits);
+				if (syscall(SYS_mbind, buf, len, MPOL_PREFERRED, nodemask,
+							sizeof(nodemask) * 8, 0))
+				{
+					std::cout << __func__ << " mbind to node " << numa_node
+						<< " failed: " << errno << std::endl;
+				}
+			}
+		}
+
+		return (char *)buf;
+	}
+
+	void OSLEnv::FreeIOBuffer(char *buf, size_t size)
+	{
+		UnmapIOBuffer(buf, size);
+	}
+
+	char *OSLEnv::BounceBuffer()
+	{
+		auto it = bounce_buffers.entries.find(instance_id);
+		if (it != bounce_buffers.entries.end())
+		{
+			return it->second.buf;
+		}
+
+		for (it = bounce_buffers.entries.begin(); it != bounce_buffers.entries.end();)
+		{
+			if (it->second.set.expired())
+			{
+				it = bounce_buffers.entries.erase(it);
+				continue;
+			}
+			it++;
+		}
+
+		char *buf = AllocIOBuffer(OSL_BOUNCE_BUF);
+		if (!buf)
+		{
+			return NULL;
+		}
+
+		{
+			std::lock_guard<std::mutex> lock(bounce_set->mutex);
+			bounce_set->buffers.insert(buf);
+		}
+
+		bounce_buffers.entries[instance_id] =
+			OSLThreadBounceBuffers::Entry{bounce_set, buf};
+		return buf;
+	}
+
+	/* Threads still running keep their entries; the set being closed tells
+	 * them the buffer is gone. */
+	void OSLEnv::ReleaseBounceBuffers()
+	{
+		std::lock_guard<std::mutex> lock(bounce_set->mutex);
+
+		for (char *buf : bounce_set->buffers)
+		{
+			FreeIOBuffer(buf, OSL_BOUNCE_BUF);
+		}
+		bounce_set->buffers.clear();
+		bounce_set->closed = true;
+	}
+
+	Status OSLEnv::PinThreadToDevice()
+	{
+		if (numa_cpus.empty())
+		{
+			return Status::OK();
+		}
+
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		for (int cpu : numa_cpus)
+		{
+			if (cpu < CPU_SETSIZE)
+			{
+				CPU_SET(cpu, &set);
+			}
+		}
+
+		if (sched_setaffinity(0, sizeof(set), &set))
+		{
+			std::cout << __func__ << " node " << numa_node << " failed: " << errno
+				<< std::endl;
+			return Status::IOError("OSL thread pinning failed");
+		}
+
+		return Status::OK();
+	}
+
+} // namespace rocksdb
@@ -0,0 +1,1009 @@
+#include <string.h>
+
+#include <algorithm>
+#include <iostream>
+#include <map>
+#include <set>
+
+#include "env_osl.h"
+#include "util/coding.h"
+#include "util/crc32c.h"
+
+namespace rocksdb
+{
+
+	/* Snapshot layout, all integers fixed width little endian:
+	 *
+	 *   magic(8) env_id(8) uuididx(8) log_gen(8) nsegments(4)
+	 *   per pack segment: id(4) fill(8) nlbas(4) lbas(4 * nlbas), nlbas
+	 *             being at most OSL_PACK_SEGMENT / OSL_ALIGMENT
+	 *   nfiles(4)
+	 *   per file: uuididx(8) size(8) mtime(8) nnames(4) names(length
+	 *             prefixed) packed(4), then either segment(4) offset(8)
+	 *             length(4) crc(4), or block_pages(4) nlbas(4)
+	 *             lbas(4 * nlbas) crcs(4 * nlbas), one per block
+	 *   crc32c of everything above(4)
+	 *
+	 * Hard links are one record with several names. Only synced bytes are
+	 * recorded, so a file reloads exactly as far as it reached the device.
+	 * Changes after the snapshot are in <namespace_path>.<log_gen>.log and
+	 * the logs after it. */
+	static const char kOSLNamespaceMagic[] = "OSLNS005";
+	static const size_t kOSLNamespaceMagicLen = 8;
+
+	/* Log layout: magic(8) gen(8) env_id(8) crc(4), then records of
+	 * length(4) crc(4) payload. Each payload is a type(1) and the final
+	 * state of what changed, so replay needs nothing but the last record
+	 * for a file; a torn record ends the log.
+	 *
+	 *   name:    uuididx(8) block_pages(4) name(length prefixed)
+	 *   unname:  name(length prefixed)
+	 *   extent:  uuididx(8) size(8) mtime(8) block_pages(4) first(4) n(4)
+	 *            lbas(4 * n) crcs(4 * n), blocks from first on
+	 *   packed:  uuididx(8) size(8) mtime(8) segment(4) offset(8) length(4)
+	 *            crc(4)
+	 *   segment: id(4) nlbas(4) lbas(4 * nlbas) */
+	static const char kOSLLogMagic[] = "OSLLG001";
+	static const size_t kOSLLogHeaderLen = 28;
+
+	enum OSLLogRecordType : char
+	{
+		kOSLLogName = 1,
+		kOSLLogUnname = 2,
+		kOSLLogExtent = 3,
+		kOSLLogPacked = 4,
+		kOSLLogSegment = 5,
+	};
+
+	struct OSLNamespaceRecord
+	{
+		std::uint64_t uuididx;
+		std::uint64_t size;
+		std::uint64_t mtime;
+		std::vector<std::string> names;
+		std::vector<uint32_t> lbas;
+		std::vector<uint32_t> crcs;
+		std::uint32_t block_pages = 1;
+
+		uint32_t packed = 0;
+		std::uint32_t pack_segment = 0;
+		std::uint64_t pack_offset = 0;
+		std::uint32_t pack_length = 0;
+		std::uint32_t pack_crc = 0;
+	};
+
+	/* What a snapshot and the logs after it describe; files are keyed by
+	 * uuididx, names map to the uuididx holding them. */
+	struct OSLNamespaceState
+	{
+		std::uint64_t env_id = 0;
+		std::uint64_t uuididx = 0;
+		std::uint64_t log_gen = 0;
+		std::map<std::uint32_t, OSLPackSegment> segments;
+		std::map<std::uint64_t, OSLNamespaceRecord> files;
+		std::map<std::string, std::uint64_t> names;
+	};
+
+	/* Forwards to the posix directory; a successful fsync is where RocksDB
+	 * expects new and renamed files to become durable. */
+	class OSLDirectory : public Directory
+	{
+		public:
+			OSLDirectory(OSLEnv *env, std::unique_ptr<Directory> &&dir)
+				: env_(env), dir_(std::move(dir))
+			{
+			}
+
+			Status Fsync() override
+			{
+				Status s = dir_->Fsync();
+				if (!s.ok())
+				{
+					return s;
+				}
+				return env_->SyncNamespace();
+			}
+
+			Status Close() override
+			{
+				return dir_->Close();
+			}
+
+			size_t GetUniqueId(char *id, size_t max_size) const override
+			{
+				return dir_->GetUniqueId(id, max_size);
+			}
+
+		private:
+			OSLEnv *env_;
+			std::unique_ptr<Directory> dir_;
+	};
+
+	Status OSLEnv::NewDirectory(const std::string &name,
+			std::unique_ptr<Directory> *result)
+	{
+		std::unique_ptr<Directory> dir;
+		Status s = posixEnv->NewDirectory(name, &dir);
+		if (!s.ok())
+		{
+			return s;
+		}
+
+		if (!persist_namespace)
+		{
+			*result = std::move(dir);
+			return Status::OK();
+		}
+
+		result->reset(new OSLDirectory(this, std::move(dir)));
+		return Status::OK();
+	}
+
+	std::string OSLEnv::LogPath(std::uint64_t gen) const
+	{
+		return env_options.namespace_path + "." + std::to_string(gen) + ".log";
+	}
+
+	/* The old log is synced before the switch: records in the next log may
+	 * depend on any record in it. */
+	Status OSLEnv::OpenLog(std::uint64_t gen)
+	{
+		Status s;
+		if (ns_log)
+		{
+			s = ns_log->Sync();
+			if (!s.ok())
+			{
+				return s;
+			}
+		}
+
+		std::unique_ptr<WritableFile> file;
+		s = posixEnv->NewWritableFile(LogPath(gen), &file, EnvOptions());
+		if (!s.ok())
+		{
+			return s;
+		}
+
+		std::string header(kOSLLogMagic, 8);
+		PutFixed64(&header, gen);
+		PutFixed64(&header, env_id);
+		PutFixed32(&header, crc32c::Value(header.data(), header.size()));
+
+		s = file->Append(header);
+		if (s.ok())
+		{
+			s = file->Sync();
+		}
+		if (!s.ok())
+		{
+			return s;
+		}
+
+		ns_log.reset(file.release());
+		ns_log_status = Status::OK();
+		log_gen = gen;
+		log_bytes = header.size();
+		return Status::OK();
+	}
+
+	void OSLEnv::AppendLog(const std::string &record)
+	{
+		std::lock_guard<std::mutex> lock(log_mutex);
+		if (!ns_log || !ns_log_status.ok())
+		{
+			return;
+		}
+
+		std::string frame;
+		PutFixed32(&frame, record.size());
+		PutFixed32(&frame, crc32c::Value(record.data(), record.size()));
+		frame.append(record);
+
+		Status s = ns_log->Append(frame);
+		if (!s.ok())
+		{
+			std::cout << __func__ << " cannot append to " << LogPath(log_gen)
+				<< ": " << s.ToString() << std::endl;
+			ns_log_status = s;
+			return;
+		}
+		log_bytes += frame.size();
+	}
+
+	void OSLEnv::LogName(const OSLFile *oslfile, const std::string &name)
+	{
+		if (!persist_namespace)
+		{
+			return;
+		}
+
+		std::string record(1, kOSLLogName);
+		PutFixed64(&record, oslfile->uuididx);
+		PutFixed32(&record, oslfile->block_pages);
+		PutLengthPrefixedSlice(&record, name);
+		AppendLog(record);
+	}
+
+	void OSLEnv::LogUnname(const std::string &name)
+	{
+		if (!persist_namespace)
+		{
+			return;
+		}
+
+		std::string record(1, kOSLLogUnname);
+		PutLengthPrefixedSlice(&record, name);
+		AppendLog(record);
+	}
+
+	void OSLEnv::LogExtent(const OSLFile *oslfile, size_t first_block)
+	{
+		if (!persist_namespace)
+		{
+			return;
+		}
+
+		size_t block = oslfile->BlockSize();
+		size_t nlbas = (oslfile->synced_size + block - 1) / block;
+		size_t n = nlbas > first_block ? nlbas - first_block : 0;
+
+		std::string record(1, kOSLLogExtent);
+		PutFixed64(&record, oslfile->uuididx);
+		PutFixed64(&record, oslfile->synced_size);
+		PutFixed64(&record, oslfile->modification_time);
+		PutFixed32(&record, oslfile->block_pages);
+		PutFixed32(&record, std::min(first_block, nlbas));
+		PutFixed32(&record, n);
+		for (size_t i = first_block; i < nlbas; i++)
+		{
+			PutFixed32(&record, oslfile->lbas[i]);
+		}
+		for (size_t i = first_block; i < nlbas; i++)
+		{
+			PutFixed32(&record, oslfile->page_crcs[i]);
+		}
+		AppendLog(record);
+	}
+
+	void OSLEnv::LogPacked(const OSLFile *oslfile)
+	{
+		if (!persist_namespace)
+		{
+			return;
+		}
+
+		std::string record(1, kOSLLogPacked);
+		PutFixed64(&record, oslfile->uuididx);
+		PutFixed64(&record, oslfile->synced_size);
+		PutFixed64(&record, oslfile->modification_time);
+		PutFixed32(&record, oslfile->pack_segment);
+		PutFixed64(&record, oslfile->pack_offset);
+		PutFixed32(&record, oslfile->pack_length);
+		PutFixed32(&record, oslfile->pack_crc);
+		AppendLog(record);
+	}
+
+	void OSLEnv::LogSegment(std::uint32_t id, const OSLPackSegment &seg)
+	{
+		if (!persist_namespace)
+		{
+			return;
+		}
+
+		std::string record(1, kOSLLogSegment);
+		PutFixed32(&record, id);
+		PutFixed32(&record, seg.lbas.size());
+		for (uint32_t lba : seg.lbas)
+		{
+			PutFixed32(&record, lba);
+		}
+		AppendLog(record);
+	}
+
+	/* Sync runs without log_mutex so appends go on meanwhile; a checkpoint
+	 * that replaces the log has synced the old one first. */
+	Status OSLEnv::SyncLog()
+	{
+		std::shared_ptr<WritableFile> log;
+		{
+			std::lock_guard<std::mutex> lock(log_mutex);
+			if (!ns_log_status.ok())
+			{
+				return ns_log_status;
+			}
+			log = ns_log;
+		}
+		if (!log)
+		{
+			return Status::OK();
+		}
+
+		Status s = log->Sync();
+		if (!s.ok())
+		{
+			std::lock_guard<std::mutex> lock(log_mutex);
+			if (log == ns_log)
+			{
+				ns_log_status = s;
+			}
+		}
+		return s;
+	}
+
+	Status OSLEnv::SyncNamespace()
+	{
+		if (!persist_namespace)
+		{
+			return Status::OK();
+		}
+
+		bool checkpoint = false;
+		Status s = SyncLog();
+		{
+			std::lock_guard<std::mutex> lock(log_mutex);
+			checkpoint = !s.ok() || log_bytes > std::max<std::uint64_t>(
+					snapshot_bytes, OSL_NAMESPACE_LOG_MIN);
+		}
+		if (!checkpoint)
+		{
+			return s;
+		}
+		return SaveNamespace();
+	}
+
+	/* A checkpoint: the snapshot covers everything logged before the switch
+	 * to the next log, which happens under the same locks. */
+	Status OSLEnv::SaveNamespace()
+	{
+		if (!persist_namespace)
+		{
+			return Status::OK();
+		}
+
+		std::lock_guard<std::mutex> snapshot_lock(snapshot_mutex);
+		std::uint64_t gen = log_gen + 1;
+		std::string data(kOSLNamespaceMagic, kOSLNamespaceMagicLen);
+		{
+			std::lock_guard<std::mutex> lock(files_mutex);
+			std::lock_guard<std::mutex> pack_lock(pack_mutex);
+			std::map<OSLFile *, std::vector<const std::string *>> names;
+
+			for (auto it = files.begin(); it != files.end(); it++)
+			{
+				names[it->second].push_back(&it->first);
+			}
+
+			PutFixed64(&data, env_id);
+			PutFixed64(&data, uuididx);
+			PutFixed64(&data, gen);
+
+			PutFixed32(&data, pack_segments.size());
+			for (auto it = pack_segments.begin(); it != pack_segments.end(); it++)
+			{
+				PutFixed32(&data, it->first);
+				PutFixed64(&data, it->second.fill);
+				PutFixed32(&data, it->second.lbas.size());
+				for (uint32_t lba : it->second.lbas)
+				{
+					PutFixed32(&data, lba);
+				}
+			}
+
+			PutFixed32(&data, names.size());
+
+			for (auto it = names.begin(); it != names.end(); it++)
+			{
+				OSLFile *oslfile = it->first;
+				size_t block = oslfile->BlockSize();
+				uint32_t nlbas = (oslfile->synced_size + block - 1) / block;
+
+				PutFixed64(&data, oslfile->uuididx);
+				PutFixed64(&data, oslfile->synced_size);
+				PutFixed64(&data, oslfile->modification_time);
+				PutFixed32(&data, it->second.size());
+				for (const std::string *name : it->second)
+				{
+					PutLengthPrefixedSlice(&data, *name);
+				}
+
+				PutFixed32(&data, oslfile->packed ? 1 : 0);
+				if (oslfile->packed)
+				{
+					PutFixed32(&data, oslfile->pack_segment);
+					PutFixed64(&data, oslfile->pack_offset);
+					PutFixed32(&data, oslfile->pack_length);
+					PutFixed32(&data, oslfile->pack_crc);
+					continue;
+				}
+
+				PutFixed32(&data, oslfile->block_pages);
+				PutFixed32(&data, nlbas);
+				for (uint32_t i = 0; i < nlbas; i++)
+				{
+					PutFixed32(&data, oslfile->lbas[i]);
+				}
+				for (uint32_t i = 0; i < nlbas; i++)
+				{
+					PutFixed32(&data, oslfile->page_crcs[i]);
+				}
+			}
+
+			std::lock_guard<std::mutex> log_lock(log_mutex);
+			Status s = OpenLog(gen);
+			if (!s.ok())
+			{
+				std::cout << __func__ << " cannot start " << LogPath(gen)
+					<< ": " << s.ToString() << std::endl;
+				return s;
+			}
+			snapshot_bytes = data.size() + 4;
+		}
+		PutFixed32(&data, crc32c::Value(data.data(), data.size()));
+
+		/* Written aside and renamed over, so a crash leaves either snapshot;
+		 * the old one still has every log it needs up to the new log. */
+		std::string tmp = env_options.namespace_path + ".tmp";
+
+		Status s = WriteStringToFile(posixEnv, data, tmp, true);
+		if (s.ok())
+		{
+			s = posixEnv->RenameFile(tmp, env_options.namespace_path);
+		}
+		if (!s.ok())
+		{
+			std::cout << __func__ << " cannot write " << env_options.namespace_path
+				<< ": " << s.ToString() << std::endl;
+			return s;
+		}
+
+		for (std::uint64_t g = snapshot_gen; g < gen; g++)
+		{
+			posixEnv->DeleteFile(LogPath(g));
+		}
+		snapshot_gen = gen;
+		return Status::OK();
+	}
+
+	static Status ParseNamespace(Slice input, OSLNamespaceState *state)
+	{
+		if (input.size() < kOSLNamespaceMagicLen + 4 ||
+				memcmp(input.data(), kOSLNamespaceMagic, kOSLNamespaceMagicLen) != 0)
+		{
+			return Status::Corruption("OSL namespace snapshot has a bad header");
+		}
+
+		uint32_t crc = DecodeFixed32(input.data() + input.size() - 4);
+		if (crc32c::Value(input.data(), input.size() - 4) != crc)
+		{
+			return Status::Corruption("OSL namespace snapshot checksum mismatch");
+		}
+
+		input.remove_prefix(kOSLNamespaceMagicLen);
+		input.remove_suffix(4);
+
+		uint32_t nsegments = 0;
+		if (!GetFixed64(&input, &state->env_id) ||
+				!GetFixed64(&input, &state->uuididx) ||
+				!GetFixed64(&input, &state->log_gen) ||
+				!GetFixed32(&input, &nsegments))
+		{
+			return Status::Corruption("OSL namespace snapshot truncated");
+		}
+
+		for (uint32_t i = 0; i < nsegments; i++)
+		{
+			OSLPackSegment seg;
+			uint32_t id = 0;
+			uint32_t nlbas = 0;
+			uint64_t fill = 0;
+
+			if (!GetFixed32(&input, &id) || !GetFixed64(&input, &fill) ||
+					!GetFixed32(&input, &nlbas) ||
+					nlbas == 0 || nlbas > OSL_PACK_SEGMENT / OSL_ALIGMENT ||
+					fill > (std::uint64_t)nlbas * OSL_ALIGMENT ||
+					input.size() < (size_t)nlbas * 4)
+			{
+				return Status::Corruption("OSL namespace snapshot truncated");
+			}
+
+			for (uint32_t j = 0; j < nlbas; j++)
+			{
+				seg.lbas.push_back(DecodeFixed32(input.data() + j * 4));
+			}
+			input.remove_prefix((size_t)nlbas * 4);
+
+			seg.fill = fill;
+			seg.live = 0;
+			seg.sealed = true;
+			if (!state->segments.emplace(id, std::move(seg)).second)
+			{
+				return Status::Corruption("OSL namespace snapshot repeats a segment");
+			}
+		}
+
+		uint32_t nfiles = 0;
+		if (!GetFixed32(&input, &nfiles))
+		{
+			return Status::Corruption("OSL namespace snapshot truncated");
+		}
+
+		for (uint32_t i = 0; i < nfiles; i++)
+		{
+			OSLNamespaceRecord record;
+			uint32_t nnames = 0;
+			uint32_t nlbas = 0;
+
+			if (!GetFixed64(&input, &record.uuididx) ||
+					!GetFixed64(&input, &record.size) ||
+					!GetFixed64(&input, &record.mtime) ||
+					!GetFixed32(&input, &nnames) || nnames == 0)
+			{
+				return Status::Corruption("OSL namespace snapshot truncated");
+			}
+
+			for (uint32_t j = 0; j < nnames; j++)
+			{
+				Slice name;
+				if (!GetLengthPrefixedSlice(&input, &name))
+				{
+					return Status::Corruption("OSL namespace snapshot truncated");
+				}
+				record.names.push_back(name.ToString());
+				if (!state->names.emplace(record.names.back(), record.uuididx).second)
+				{
+					return Status::Corruption("OSL namespace snapshot repeats a name",
+							record.names.back());
+				}
+			}
+
+			if (!GetFixed32(&input, &record.packed))
+			{
+				return Status::Corruption("OSL namespace snapshot truncated");
+			}
+
+			if (record.packed)
+			{
+				if (!GetFixed32(&input, &record.pack_segment) ||
+						!GetFixed64(&input, &record.pack_offset) ||
+						!GetFixed32(&input, &record.pack_length) ||
+						!GetFixed32(&input, &record.pack_crc))
+				{
+					return Status::Corruption("OSL namespace snapshot truncated");
+				}
+			}
+			else
+			{
+				if (!GetFixed32(&input, &record.block_pages) ||
+						!GetFixed32(&input, &nlbas) ||
+						input.size() < (size_t)nlbas * 8)
+				{
+					return Status::Corruption("OSL namespace snapshot truncated");
+				}
+
+				for (uint32_t j = 0; j < nlbas; j++)
+				{
+					record.lbas.push_back(DecodeFixed32(input.data() + j * 4));
+					record.crcs.push_back(DecodeFixed32(input.data() + (nlbas + j) * 4));
+				}
+				input.remove_prefix((size_t)nlbas * 8);
+			}
+
+			std::uint64_t id = record.uuididx;
+			if (!state->files.emplace(id, std::move(record)).second)
+			{
+				return Status::Corruption("OSL namespace snapshot repeats a file");
+			}
+		}
+
+		if (!input.empty())
+		{
+			return Status::Corruption("OSL namespace snapshot has trailing bytes");
+		}
+		return Status::OK();
+	}
+
+	static void UnnameRecord(OSLNamespaceState *state, const std::string &name)
+	{
+		auto owner = state->names.find(name);
+		if (owner == state->names.end())
+		{
+			return;
+		}
+
+		std::vector<std::string> &names = state->files[owner->second].names;
+		names.erase(std::remove(names.begin(), names.end(), name), names.end());
+		state->names.erase(owner);
+	}
+
+	static OSLNamespaceRecord *FindRecord(OSLNamespaceState *state,
+			std::uint64_t uuididx)
+	{
+		OSLNamespaceRecord &record = state->files[uuididx];
+		record.uuididx = uuididx;
+		state->uuididx = std::max(state->uuididx, uuididx + 1);
+		return &record;
+	}
+
+	static Status ApplyLogRecord(Slice input, OSLNamespaceState *state)
+	{
+		if (input.empty())
+		{
+			return Status::Corruption("OSL namespace log has an empty record");
+		}
+		char type = input[0];
+		input.remove_prefix(1);
+
+		std::uint64_t uuididx = 0;
+		Slice name;
+
+		switch (type)
+		{
+			case kOSLLogName:
+			{
+				uint32_t block_pages = 0;
+				if (!GetFixed64(&input, &uuididx) || !GetFixed32(&input, &block_pages) ||
+						!GetLengthPrefixedSlice(&input, &name))
+				{
+					break;
+				}
+				UnnameRecord(state, name.ToString());
+				OSLNamespaceRecord *record = FindRecord(state, uuididx);
+				if (record->names.empty() && record->lbas.empty() && !record->packed)
+				{
+					record->block_pages = block_pages;
+				}
+				record->names.push_back(name.ToString());
+				state->names[name.ToString()] = uuididx;
+				return input.empty() ? Status::OK() :
+					Status::Corruption("OSL namespace log has a bad name record");
+			}
+
+			case kOSLLogUnname:
+				if (!GetLengthPrefixedSlice(&input, &name))
+				{
+					break;
+				}
+				UnnameRecord(state, name.ToString());
+				return input.empty() ? Status::OK() :
+					Status::Corruption("OSL namespace log has a bad unname record");
+
+			case kOSLLogExtent:
+			{
+				std::uint64_t size = 0;
+				std::uint64_t mtime = 0;
+				uint32_t block_pages = 0;
+				uint32_t first = 0;
+				uint32_t n = 0;
+				if (!GetFixed64(&input, &uuididx) || !GetFixed64(&input, &size) ||
+						!GetFixed64(&input, &mtime) || !GetFixed32(&input, &block_pages) ||
+						!GetFixed32(&input, &first) || !GetFixed32(&input, &n) ||
+						input.size() != (size_t)n * 8)
+				{
+					break;
+				}
+
+				OSLNamespaceRecord *record = FindRecord(state, uuididx);
+				if (record->packed || first > record->lbas.size())
+				{
+					first = 0;
+					record->lbas.clear();
+					record->crcs.clear();
+				}
+				record->lbas.resize(first);
+				record->crcs.resize(first);
+				for (uint32_t j = 0; j < n; j++)
+				{
+					record->lbas.push_back(DecodeFixed32(input.data() + j * 4));
+					record->crcs.push_back(DecodeFixed32(input.data() + (n + j) * 4));
+				}
+				record->size = size;
+				record->mtime = mtime;
+				record->block_pages = block_pages;
+				record->packed = 0;
+				return Status::OK();
+			}
+
+			case kOSLLogPacked:
+			{
+				OSLNamespaceRecord record;
+				if (!GetFixed64(&input, &uuididx) || !GetFixed64(&input, &record.size) ||
+						!GetFixed64(&input, &record.mtime) ||
+						!GetFixed32(&input, &record.pack_segment) ||
+						!GetFixed64(&input, &record.pack_offset) ||
+						!GetFixed32(&input, &record.pack_length) ||
+						!GetFixed32(&input, &record.pack_crc) || !input.empty())
+				{
+					break;
+				}
+
+				OSLNamespaceRecord *target = FindRecord(state, uuididx);
+				record.uuididx = uuididx;
+				record.names.swap(target->names);
+				record.packed = 1;
+				*target = std::move(record);
+
+				/* Segment fill is not logged: it is at least the end of
+				 * every extent written to it. */
+				auto seg = state->segments.find(target->pack_segment);
+				if (seg != state->segments.end())
+				{
+					seg->second.fill = std::max<std::uint64_t>(seg->second.fill,
+							target->pack_offset + target->pack_length);
+				}
+				return Status::OK();
+			}
+
+			case kOSLLogSegment:
+			{
+				OSLPackSegment seg;
+				uint32_t id = 0;
+				uint32_t nlbas = 0;
+				if (!GetFixed32(&input, &id) || !GetFixed32(&input, &nlbas) ||
+						nlbas == 0 || nlbas > OSL_PACK_SEGMENT / OSL_ALIGMENT ||
+						input.size() != (size_t)nlbas * 4)
+				{
+					break;
+				}
+				for (uint32_t j = 0; j < nlbas; j++)
+				{
+					seg.lbas.push_back(DecodeFixed32(input.data() + j * 4));
+				}
+				seg.fill = 0;
+				seg.live = 0;
+				seg.sealed = true;
+				state->segments[id] = std::move(seg);
+				return Status::OK();
+			}
+
+			default:
+				return Status::Corruption("OSL namespace log has an unknown record");
+		}
+		return Status::Corruption("OSL namespace log has a bad record");
+	}
+
+	/* Applies one log; NotFound if it does not exist. A log whose header
+	 * never reached the device is empty, and a torn record ends it. */
+	static Status ReplayLog(Slice input, std::uint64_t gen, OSLNamespaceState *state)
+	{
+		if (input.size() < kOSLLogHeaderLen)
+		{
+			return Status::OK();
+		}
+		if (memcmp(input.data(), kOSLLogMagic, 8) != 0 ||
+				DecodeFixed64(input.data() + 8) != gen ||
+				crc32c::Value(input.data(), kOSLLogHeaderLen - 4) !=
+				DecodeFixed32(input.data() + kOSLLogHeaderLen - 4))
+		{
+			return Status::Corruption("OSL namespace log has a bad header");
+		}
+		state->env_id = DecodeFixed64(input.data() + 16);
+		input.remove_prefix(kOSLLogHeaderLen);
+
+		while (input.size() >= 8)
+		{
+			uint32_t length = DecodeFixed32(input.data());
+			uint32_t crc = DecodeFixed32(input.data() + 4);
+			if (input.size() - 8 < length ||
+					crc32c::Value(input.data() + 8, length) != crc)
+			{
+				break;
+			}
+
+			Status s = ApplyLogRecord(Slice(input.data() + 8, length), state);
+			if (!s.ok())
+			{
+				return s;
+			}
+			input.remove_prefix(8 + (size_t)length);
+		}
+		return Status::OK();
+	}
+
+	/* Drops nameless files and checks what is left; segment live bytes are
+	 * only known once every file is final. */
+	static Status CheckNamespace(OSLNamespaceState *state)
+	{
+		for (auto it = state->segments.begin(); it != state->segments.end(); it++)
+		{
+			it->second.live = 0;
+		}
+
+		for (auto it = state->files.begin(); it != state->files.end();)
+		{
+			OSLNamespaceRecord &record = it->second;
+			if (record.names.empty())
+			{
+				it = state->files.erase(it);
+				continue;
+			}
+
+			if (record.packed)
+			{
+				auto seg = state->segments.find(record.pack_segment);
+				if (seg == state->segments.end() || record.size > record.pack_length ||
+						record.pack_offset + record.pack_length > seg->second.fill)
+				{
+					return Status::Corruption("OSL namespace has a bad pack extent",
+							record.names[0]);
+				}
+				seg->second.live += record.pack_length;
+				it++;
+				continue;
+			}
+
+			if (record.block_pages == 0 ||
+					record.block_pages > OSL_MAX_BLOCK / OSL_ALIGMENT ||
+					(record.block_pages & (record.block_pages - 1)) != 0)
+			{
+				return Status::Corruption("OSL namespace has a bad block size",
+						record.names[0]);
+			}
+
+			size_t block = (size_t)record.block_pages * OSL_ALIGMENT;
+			if (record.lbas.size() != (record.size + block - 1) / block)
+			{
+				return Status::Corruption("OSL namespace has a bad extent",
+						record.names[0]);
+			}
+			it++;
+		}
+		return Status::OK();
+	}
+
+	/* Fills an empty namespace from the snapshot and the logs after it, and
+	 * takes the LBAs it uses out of the allocator. Nothing changes unless
+	 * the whole namespace is valid; an invalid one is never overwritten by
+	 * SaveNamespace. */
+	Status OSLEnv::LoadNamespace()
+	{
+		if (env_options.namespace_path.empty())
+		{
+			return Status::InvalidArgument("OSL namespace_path is not set");
+		}
+
+		OSLNamespaceState state;
+		bool found = false;
+		std::string data;
+		Status s = posixEnv->FileExists(env_options.namespace_path);
+		if (s.ok())
+		{
+			s = ReadFileToString(posixEnv, env_options.namespace_path, &data);
+			if (s.ok())
+			{
+				s = ParseNamespace(data, &state);
+			}
+			found = true;
+		}
+		else if (s.IsNotFound())
+		{
+			/* The first checkpoint starts log 1 before its snapshot is in
+			 * place; a crash in between leaves only the log. */
+			state.env_id = env_id;
+			state.log_gen = 1;
+			s = Status::OK();
+		}
+
+		std::uint64_t gen = state.log_gen;
+		for (; s.ok(); gen++)
+		{
+			s = posixEnv->FileExists(LogPath(gen));
+			if (s.IsNotFound())
+			{
+				s = Status::OK();
+				break;
+			}
+			if (s.ok())
+			{
+				s = ReadFileToString(posixEnv, LogPath(gen), &data);
+			}
+			if (s.ok())
+			{
+				s = ReplayLog(data, gen, &state);
+			}
+			found = true;
+		}
+		if (s.ok() && !found)
+		{
+			return Status::NotFound("OSL namespace snapshot",
+					env_options.namespace_path);
+		}
+		if (s.ok())
+		{
+			s = CheckNamespace(&state);
+		}
+
+		std::lock_guard<std::mutex> files_lock(files_mutex);
+		std::lock_guard<std::mutex> pack_lock(pack_mutex);
+		std::vector<uint32_t> used;
+
+		if (!files.empty() || !pack_segments.empty())
+		{
+			return Status::InvalidArgument("OSL namespace is already populated");
+		}
+
+		/* Segments without live bytes are dropped; their LBAs stay free. */
+		for (auto it = state.segments.begin(); it != state.segments.end() && s.ok();)
+		{
+			if (it->second.live == 0)
+			{
+				it = state.segments.erase(it);
+				continue;
+			}
+			used.insert(used.end(), it->second.lbas.begin(), it->second.lbas.end());
+			it++;
+		}
+
+		for (auto it = state.files.begin(); it != state.files.end() && s.ok(); it++)
+		{
+			const OSLNamespaceRecord &record = it->second;
+			for (size_t j = 0; j < record.lbas.size() * record.block_pages; j++)
+			{
+				used.push_back(record.lbas[j / record.block_pages] +
+						j % record.block_pages);
+			}
+		}
+
+		/* The LBAs must still be free: on a shared device, another tenant
+		 * holding one means the snapshots overlap. */
+		if (s.ok())
+		{
+			s = device->ClaimLBAs(env_options.tenant, used);
+		}
+
+		if (!s.ok())
+		{
+			std::cout << __func__ << " " << env_options.namespace_path << ": "
+				<< s.ToString() << ", not persisting the namespace" << std::endl;
+			persist_namespace = false;
+			return s;
+		}
+		used_pages += (std::int64_t)used.size();
+
+		for (auto it = state.files.begin(); it != state.files.end(); it++)
+		{
+			OSLNamespaceRecord &record = it->second;
+			OSLFile *oslfile = new OSLFile(record.names[0]);
+			oslfile->uuididx = record.uuididx;
+			oslfile->size = record.size;
+			oslfile->synced_size = record.size;
+			oslfile->modification_time = record.mtime;
+			oslfile->lbas.swap(record.lbas);
+			oslfile->page_crcs.swap(record.crcs);
+			oslfile->block_pages = record.block_pages;
+			oslfile->links = record.names.size();
+			oslfile->refs = record.names.size();
+			oslfile->packed = record.packed != 0;
+			oslfile->pack_segment = record.pack_segment;
+			oslfile->pack_offset = record.pack_offset;
+			oslfile->pack_length = record.pack_length;
+			oslfile->pack_crc = record.pack_crc;
+
+			for (const std::string &name : record.names)
+			{
+				files[name] = oslfile;
+			}
+		}
+
+		for (auto it = state.segments.begin(); it != state.segments.end(); it++)
+		{
+			next_segment = std::max(next_segment, it->first + 1);
+			if (it->second.live * 2 < it->second.fill)
+			{
+				pack_gc_pending = true;
+			}
+		}
+		pack_segments.swap(state.segments);
+
+		uuididx = std::max(uuididx, state.uuididx);
+		env_id = state.env_id;
+
+		/* The next checkpoint starts the log after the last one replayed and
+		 * deletes the ones before it. */
+		snapshot_gen = state.log_gen;
+		log_gen = gen > state.log_gen ? gen - 1 : gen;
+
+		return Status::OK();
+	}
+
+} // namespace rocksdb
@@ -0,0 +1,399 @@
+#include <string.h>
+
+#include <iostream>
+#include <set>
+
+#include "env_osl.h"
+#include "util/crc32c.h"
+
+namespace rocksdb
+{
+
+	/* ### Pack segments ### */
+
+	Status OSLEnv::PackBytes(const char *data, size_t n, OSLIOClass io_class,
+			std::uint32_t *segment, std::uint64_t *offset)
+	{
+		if (n == 0 || n > pack_segment_bytes)
+		{
+			return Status::InvalidArgument("OSL pack extent size out of range");
+		}
+
+		char *pages = BounceBuffer();
+		if (pages == NULL)
+		{
+			return Status::IOError("OSL bounce buffer allocation failed");
+		}
+
+		std::unique_lock<std::mutex> lock(pack_mutex);
+
+		if (!pack_buffer)
+		{
+			pack_buffer = AllocIOBuffer(OSL_PACK_SEGMENT);
+			if (!pack_buffer)
+			{
+				return Status::IOError("OSL pack buffer allocation failed");
+			}
+		}
+
+		auto it = pack_segments.find(active_segment);
+		if (it == pack_segments.end() ||
+				it->second.fill + n > it->second.lbas.size() * OSL_ALIGMENT)
+		{
+			OSLPackSegment next;
+			Status s = AllocateLBAs(pack_segment_bytes / OSL_ALIGMENT, &next.lbas);
+			if (!s.ok())
+			{
+				return s;
+			}
+			next.fill = 0;
+			next.live = 0;
+			next.sealed = false;
+
+			if (it != pack_segments.end())
+			{
+				it->second.sealed = true;
+				FreeSegmentIfDead(active_segment);
+			}
+
+			active_segment = next_segment++;
+			it = pack_segments.emplace(active_segment, std::move(next)).first;
+			LogSegment(active_segment, it->second);
+		}
+
+		/* The range counts as live from here on, so the segment outlives
+		 * the write even if it is sealed meanwhile. */
+		OSLPackSegment &seg = it->second;
+		std::uint32_t id = active_segment;
+		std::uint64_t fill = seg.fill;
+		size_t first = fill / OSL_ALIGMENT;
+		size_t end = (fill + n + OSL_ALIGMENT - 1) / OSL_ALIGMENT;
+		std::vector<uint32_t> lbas(seg.lbas.begin() + first, seg.lbas.begin() + end);
+
+		memcpy(pack_buffer + fill, data, n);
+		memcpy(pages, pack_buffer + first * OSL_ALIGMENT, (end - first) * OSL_ALIGMENT);
+		seg.fill += n;
+		seg.live += n;
+
+		/* The first page holds the tail of the extent before, so the
+		 * rewrites of a shared page must reach the device in order. */
+		std::uint64_t ticket = pack_tickets++;
+		pack_cv.wait(lock, [&] { return pack_turn == ticket; });
+		lock.unlock();
+
+		Status s;
+		{
+			OSLIOGrant grant(GetIOScheduler(), GetIOTenant(), io_class, true);
+			for (size_t i = 0; i < lbas.size() && s.ok(); i++)
+			{
+				grant.Page((lbas.size() - i) * OSL_ALIGMENT);
+				s = WriteLBA(lbas[i], pages + i * OSL_ALIGMENT);
+				if (!s.ok())
+				{
+					std::cout << __func__ << " segment: " << id
+						<< " (write) error on page " << first + i << std::endl;
+				}
+			}
+		}
+
+		lock.lock();
+		pack_turn++;
+		pack_cv.notify_all();
+
+		if (!s.ok())
+		{
+			auto dead = pack_segments.find(id);
+			if (dead != pack_segments.end())
+			{
+				dead->second.live -= std::min<size_t>(dead->second.live, n);
+				FreeSegmentIfDead(id);
+			}
+			return s;
+		}
+
+		*segment = id;
+		*offset = fill;
+		return Status::OK();
+	}
+
+	/* Called with pack_mutex held. */
+	void OSLEnv::FreeSegmentIfDead(std::uint32_t segment)
+	{
+		auto it = pack_segments.find(segment);
+		if (it == pack_segments.end() || !it->second.sealed)
+		{
+			return;
+		}
+
+		if (it->second.live == 0)
+		{
+			if (it->second.readers > 0)
+			{
+				return;
+			}
+			FreeLBAs(it->second.lbas);
+			pack_segments.erase(it);
+		}
+		else if (it->second.live * 2 < it->second.fill)
+		{
+			pack_gc_pending = true;
+		}
+	}
+
+	void OSLEnv::ReleasePacked(std::uint32_t segment, size_t length)
+	{
+		std::lock_guard<std::mutex> lock(pack_mutex);
+
+		auto it = pack_segments.find(segment);
+		if (it == pack_segments.end())
+		{
+			return;
+		}
+
+		it->second.live -= std::min(it->second.live, length);
+		FreeSegmentIfDead(segment);
+	}
+
+	Status OSLEnv::PinPackExtent(std::uint32_t segment, std::uint64_t offset,
+			size_t length, std::vector<uint32_t> *lbas)
+	{
+		size_t first = offset / OSL_ALIGMENT;
+		size_t end = (offset + length + OSL_ALIGMENT - 1) / OSL_ALIGMENT;
+
+		auto it = pack_segments.find(segment);
+		if (it == pack_segments.end() || offset + length > it->second.fill)
+		{
+			return Status::Corruption("OSL packed extent outside its segment");
+		}
+
+		lbas->assign(it->second.lbas.begin() + first, it->second.lbas.begin() + end);
+		it->second.readers++;
+		return Status::OK();
+	}
+
+	void OSLEnv::UnpinSegment(std::uint32_t segment)
+	{
+		std::lock_guard<std::mutex> lock(pack_mutex);
+
+		auto it = pack_segments.find(segment);
+		if (it != pack_segments.end() && --it->second.readers == 0)
+		{
+			FreeSegmentIfDead(segment);
+		}
+	}
+
+	/* Reads a whole packed extent, whose pages are lbas, through the bounce
+	 * buffer, checks it against crc and copies [sub_offset, sub_offset + n)
+	 * of it to dst. */
+	Status OSLEnv::ReadPackExtent(const std::vector<uint32_t> &lbas,
+			std::uint64_t offset, size_t length, std::uint32_t crc,
+			uint64_t sub_offset, size_t n, char *dst)
+	{
+		char *buf = BounceBuffer();
+		if (buf == NULL)
+		{
+			return Status::IOError("OSL bounce buffer allocation failed");
+		}
+
+		OSLIOGrant grant(GetIOScheduler(), GetIOTenant(),
+				OSLIOScheduler::ThreadReadClass(), false);
+		for (size_t i = 0; i < lbas.size(); i++)
+		{
+			grant.Page((lbas.size() - i) * OSL_ALIGMENT);
+			Status s = ReadLBA(lbas[i], buf + i * OSL_ALIGMENT);
+			if (!s.ok())
+			{
+				return s;
+			}
+		}
+
+		const char *data = buf + offset % OSL_ALIGMENT;
+		if (crc32c::Value(data, length) != crc)
+		{
+			std::cout << __func__ << " checksum mismatch at " << offset << std::endl;
+			return Status::Corruption("OSL packed extent checksum mismatch");
+		}
+
+		memcpy(dst, data + sub_offset, n);
+		return Status::OK();
+	}
+
+	/* The segment is pinned under files_mutex, before a repack or collection
+	 * can move the file out of it and free it. */
+	Status OSLEnv::ReadPacked(const OSLFile *oslfile, uint64_t offset, size_t n,
+			char *scratch)
+	{
+		std::uint32_t segment;
+		std::uint64_t pack_offset;
+		std::uint32_t length;
+		std::uint32_t crc;
+		std::vector<uint32_t> lbas;
+
+		{
+			std::lock_guard<std::mutex> lock(files_mutex);
+			if (!oslfile->packed)
+			{
+				return Status::TryAgain();
+			}
+			segment = oslfile->pack_segment;
+			pack_offset = oslfile->pack_offset;
+			length = oslfile->pack_length;
+			crc = oslfile->pack_crc;
+
+			if (offset + n > length)
+			{
+				return Status::IOError("OSL read past packed extent", oslfile->name);
+			}
+
+			std::lock_guard<std::mutex> pack_lock(pack_mutex);
+			Status s = PinPackExtent(segment, pack_offset, length, &lbas);
+			if (!s.ok())
+			{
+				return s;
+			}
+		}
+
+		Status s = ReadPackExtent(lbas, pack_offset, length, crc, offset, n, scratch);
+		UnpinSegment(segment);
+		return s;
+	}
+
+	/* Relocates the live files of every sealed segment that is less than
+	 * half live into the active segment; the victim is freed once the last
+	 * of them has moved. The movers are pinned and referenced under the
+	 * locks, and copied without them. */
+	Status OSLEnv::CollectPackSegments()
+	{
+		struct Mover
+		{
+			OSLFile *oslfile;
+			std::uint32_t segment;
+			std::uint64_t offset;
+			std::uint32_t length;
+			std::uint32_t crc;
+			std::vector<uint32_t> lbas;
+		};
+
+		std::set<std::uint32_t> victims;
+		{
+			std::lock_guard<std::mutex> lock(pack_mutex);
+			if (!pack_gc_pending)
+			{
+				return Status::OK();
+			}
+			pack_gc_pending = false;
+
+			for (auto it = pack_segments.begin(); it != pack_segments.end(); it++)
+			{
+				if (it->second.sealed && it->second.live * 2 < it->second.fill)
+				{
+					victims.insert(it->first);
+				}
+			}
+		}
+
+		std::vector<Mover> movers;
+		{
+			std::lock_guard<std::mutex> lock(files_mutex);
+			std::lock_guard<std::mutex> pack_lock(pack_mutex);
+			std::set<OSLFile *> seen;
+
+			for (auto it = files.begin(); it != files.end(); it++)
+			{
+				OSLFile *oslfile = it->second;
+				if (oslfile == NULL || !oslfile->packed ||
+						victims.count(oslfile->pack_segment) == 0 ||
+						!seen.insert(oslfile).second)
+				{
+					continue;
+				}
+
+				Mover m;
+				m.oslfile = oslfile;
+				m.segment = oslfile->pack_segment;
+				m.offset = oslfile->pack_offset;
+				m.length = oslfile->pack_length;
+				m.crc = oslfile->pack_crc;
+				if (PinPackExtent(m.segment, m.offset, m.length, &m.lbas).ok())
+				{
+					oslfile->Ref();
+					movers.push_back(std::move(m));
+				}
+			}
+		}
+
+		Status s;
+		std::string data;
+		std::vector<Mover *> moved_from;
+
+		for (Mover &m : movers)
+		{
+			std::uint32_t segment = 0;
+			std::uint64_t offset = 0;
+
+			if (s.ok())
+			{
+				data.resize(m.length);
+				s = ReadPackExtent(m.lbas, m.offset, m.length, m.crc, 0, m.length,
+						&data[0]);
+				if (s.ok())
+				{
+					s = PackBytes(data.data(), data.size(), OSL_IO_COMPACTION, &segment,
+							&offset);
+				}
+				if (!s.ok())
+				{
+					std::cout << __func__ << " file: " << m.oslfile->name
+						<< " not moved: " << s.ToString() << std::endl;
+				}
+			}
+			UnpinSegment(m.segment);
+
+			if (s.ok())
+			{
+				/* A file repacked or deleted meanwhile keeps what it has now,
+				 * and the copy is dead on arrival. */
+				bool moved;
+				{
+					std::lock_guard<std::mutex> lock(files_mutex);
+					moved = m.oslfile->links > 0 && m.oslfile->packed &&
+						m.oslfile->pack_segment == m.segment &&
+						m.oslfile->pack_offset == m.offset;
+					if (moved)
+					{
+						m.oslfile->pack_segment = segment;
+						m.oslfile->pack_offset = offset;
+						LogPacked(m.oslfile);
+					}
+				}
+				if (moved)
+				{
+					moved_from.push_back(&m);
+				}
+				else
+				{
+					ReleasePacked(segment, m.length);
+				}
+			}
+			UnrefFile(m.oslfile);
+		}
+
+		/* The old copies can be reused once the log no longer points at
+		 * them; if it cannot be synced they stay allocated until restart. */
+		if (!moved_from.empty())
+		{
+			Status ls = SyncLog();
+			if (!ls.ok())
+			{
+				return s.ok() ? ls : s;
+			}
+			for (Mover *m : moved_from)
+			{
+				ReleasePacked(m->segment, m->length);
+			}
+		}
+
+		return s;
+	}
+
+} // namespace rocksdb
@@ -0,0 +1,201 @@
+#include <algorithm>
+#include <iostream>
+
+#include "env_osl.h"
+
+namespace rocksdb
+{
+
+	/* Completion of one Run(): the caller sleeps until pending drops to 0. */
+	struct OSLSubmitQueues::Request
+	{
+		std::mutex mutex;
+		std::condition_variable cv;
+		size_t pending;
+		Status status;
+
+		void Done(const Status &s)
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			if (!s.ok() && status.ok())
+			{
+				status = s;
+			}
+			if (--pending == 0)
+			{
+				cv.notify_one();
+			}
+		}
+	};
+
+	/* ### OSLSubmitQueues ### */
+
+	OSLSubmitQueues::OSLSubmitQueues(OSLEnv *env, int nqueues)
+		: env_(env), next_queue_(0), shutdown_(false)
+	{
+		for (int i = 0; i < nqueues; i++)
+		{
+			queues_.emplace_back(new Queue());
+		}
+		for (auto &queue : queues_)
+		{
+			queue->worker = std::thread(&OSLSubmitQueues::WorkerLoop, this, queue.get());
+		}
+	}
+
+	OSLSubmitQueues::~OSLSubmitQueues()
+	{
+		shutdown_ = true;
+		for (auto &queue : queues_)
+		{
+			std::lock_guard<std::mutex> lock(queue->mutex);
+			queue->cv.notify_all();
+		}
+		for (auto &queue : queues_)
+		{
+			queue->worker.join();
+		}
+	}
+
+	void OSLSubmitQueues::WorkerLoop(Queue *queue)
+	{
+		env_->PinThreadToDevice();
+
+		for (;;)
+		{
+			Task task;
+			{
+				std::unique_lock<std::mutex> lock(queue->mutex);
+				queue->cv.wait(lock, [&] { return shutdown_ || queue->ntasks != 0; });
+				if (queue->ntasks == 0)
+				{
+					return;
+				}
+
+				/* OSLIOClass is ordered by priority. */
+				int c = 0;
+				while (queue->tasks[c].empty())
+				{
+					c++;
+				}
+				task = queue->tasks[c].front();
+				queue->tasks[c].pop_front();
+				queue->ntasks--;
+			}
+			task.request->Done((*task.chunk)());
+		}
+	}
+
+	Status OSLSubmitQueues::Run(const std::vector<std::function<Status()>> &chunks,
+			OSLIOClass io_class)
+	{
+		if (chunks.empty())
+		{
+			return Status::OK();
+		}
+
+		Request request;
+		request.pending = chunks.size();
+
+		/* Rotate the starting queue so concurrent callers spread out. */
+		unsigned int start = next_queue_++;
+		for (size_t i = 1; i < chunks.size(); i++)
+		{
+			Queue *queue = queues_[(start + i) % queues_.size()].get();
+			std::lock_guard<std::mutex> lock(queue->mutex);
+			queue->tasks[io_class].push_back(Task{&request, &chunks[i]});
+			queue->ntasks++;
+			queue->cv.notify_one();
+		}
+
+		request.Done(chunks[0]());
+
+		std::unique_lock<std::mutex> lock(request.mutex);
+		request.cv.wait(lock, [&] { return request.pending == 0; });
+		return request.status;
+	}
+
+	/* ### Chunked transfers ### */
+
+	Status OSLEnv::SubmitChunked(uint64_t offset, size_t n, OSLIOClass io_class,
+			const std::function<Status(uint64_t, size_t)> &transfer, size_t chunk)
+	{
+		uint64_t end = offset + n;
+
+		if (!submit_queues || n == 0 || offset / chunk == (end - 1) / chunk)
+		{
+			return transfer(offset, n);
+		}
+
+		/* The I/O class belongs to the caller, not to the worker running
+		 * the chunk, so transfer must not derive it from the thread. */
+		std::vector<std::function<Status()>> chunks;
+		while (offset < end)
+		{
+			uint64_t next = std::min<uint64_t>(end, (offset / chunk + 1) * chunk);
+			chunks.push_back([&transfer, offset, next]() {
+					return transfer(offset, next - offset);
+					});
+			offset = next;
+		}
+
+		return submit_queues->Run(chunks, io_class);
+	}
+
+	/* ### Readahead ### */
+
+	std::future<Status> OSLEnv::SubmitReadahead(std::function<Status()> fetch)
+	{
+		std::packaged_task<Status()> task(std::move(fetch));
+		std::future<Status> result = task.get_future();
+
+		std::lock_guard<std::mutex> lock(readahead_mutex);
+		if (!readahead_thread.joinable())
+		{
+			readahead_thread = std::thread(&OSLEnv::ReadaheadLoop, this);
+		}
+		readahead_tasks.push_back(std::move(task));
+		readahead_cv.notify_one();
+
+		return result;
+	}
+
+	/* One long-lived thread, so that its bounce buffer is reused, and one
+	 * that is not a submission queue worker, so that its chunked reads
+	 * cannot wait on a queue that is waiting on it. */
+	void OSLEnv::ReadaheadLoop()
+	{
+		PinThreadToDevice();
+
+		for (;;)
+		{
+			std::packaged_task<Status()> task;
+			{
+				std::unique_lock<std::mutex> lock(readahead_mutex);
+				readahead_cv.wait(lock,
+						[&] { return readahead_shutdown || !readahead_tasks.empty(); });
+				if (readahead_tasks.empty())
+				{
+					return;
+				}
+				task = std::move(readahead_tasks.front());
+				readahead_tasks.pop_front();
+			}
+			task();
+		}
+	}
+
+	void OSLEnv::StopReadahead()
+	{
+		{
+			std::lock_guard<std::mutex> lock(readahead_mutex);
+			readahead_shutdown = true;
+			readahead_cv.notify_all();
+		}
+		if (readahead_thread.joinable())
+		{
+			readahead_thread.join();
+		}
+	}
+
+} // namespace rocksdb
@@ -0,0 +1,301 @@
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include <iostream>
+
+#include "env/composite_env_wrapper.h"
+#include "env_osl.h"
+#include "rocksdb/utilities/object_registry.h"
+
+namespace rocksdb
+{
+
+	/* ### URI options ### */
+
+	static bool ParseOSLUint(const std::string &value, std::uint64_t *out)
+	{
+		char *end = NULL;
+
+		if (value.empty() || value[0] == '-')
+		{
+			return false;
+		}
+
+		errno = 0;
+		*out = strtoull(value.c_str(), &end, 10);
+		return errno == 0 && *end == '\0';
+	}
+
+	static bool ParseOSLInt(const std::string &value, int *out)
+	{
+		char *end = NULL;
+
+		if (value.empty())
+		{
+			return false;
+		}
+
+		errno = 0;
+		long n = strtol(value.c_str(), &end, 10);
+		*out = (int)n;
+		return errno == 0 && *end == '\0' && n == *out;
+	}
+
+	static bool ParseOSLBool(const std::string &value, bool *out)
+	{
+		if (value == "true" || value == "1")
+		{
+			*out = true;
+			return true;
+		}
+		if (value == "false" || value == "0")
+		{
+			*out = false;
+			return true;
+		}
+		return false;
+	}
+
+	static Status SetOSLEnvOption(const std::string &name, const std::string &value,
+			OSLEnvOptions *opts)
+	{
+		std::uint64_t n = 0;
+		bool ok = false;
+
+		if (name == "numa_aware")
+		{
+			ok = ParseOSLBool(value, &opts->numa_aware);
+		}
+		else if (name == "numa_node")
+		{
+			ok = ParseOSLInt(value, &opts->numa_node);
+		}
+		else if (name == "use_huge_pages")
+		{
+			ok = ParseOSLBool(value, &opts->use_huge_pages);
+		}
+		else if (name == "queue_depth")
+		{
+			ok = ParseOSLInt(value, &opts->queue_depth);
+		}
+		else if (name == "submit_queues")
+		{
+			ok = ParseOSLInt(value, &opts->submit_queues);
+		}
+		else if (name == "pack_threshold")
+		{
+			ok = ParseOSLUint(value, &n);
+			opts->pack_threshold = n;
+		}
+		else if (name == "bg_write_bytes_per_sec")
+		{
+			ok = ParseOSLUint(value, &opts->bg_write_bytes_per_sec);
+		}
+		else if (name == "namespace_path")
+		{
+			ok = !value.empty();
+			opts->namespace_path = value;
+		}
+		else if (name == "page_cache_bytes")
+		{
+			ok = ParseOSLUint(value, &n);
+			opts->page_cache_bytes = n;
+		}
+		else if (name == "warmup_profile_path")
+		{
+			ok = !value.empty();
+			opts->warmup_profile_path = value;
+		}
+		else if (name == "warmup_bytes")
+		{
+			ok = ParseOSLUint(value, &n);
+			opts->warmup_bytes = n;
+		}
+		else if (name == "warmup_threads")
+		{
+			ok = ParseOSLInt(value, &opts->warmup_threads);
+		}
+		else if (name == "wal_block_size")
+		{
+			ok = ParseOSLUint(value, &n);
+			opts->wal_block_size = n;
+		}
+		else if (name == "sst_block_size")
+		{
+			ok = ParseOSLUint(value, &n);
+			opts->sst_block_size = n;
+		}
+		else if (name == "tier_path")
+		{
+			ok = !value.empty();
+			opts->tier_path = value;
+		}
+		else if (name == "tier_capacity")
+		{
+			ok = ParseOSLUint(value, &opts->tier_capacity);
+		}
+		else if (name == "tier_interval_sec")
+		{
+			ok = ParseOSLInt(value, &opts->tier_interval_sec);
+		}
+		else if (name == "tier_promote_score")
+		{
+			ok = ParseOSLUint(value, &n) && n <= UINT32_MAX;
+			opts->tier_promote_score = n;
+		}
+		else if (name == "tenant")
+		{
+			ok = !value.empty();
+			opts->tenant = value;
+		}
+		else if (name == "tenant_weight")
+		{
+			ok = ParseOSLUint(value, &n) && n > 0 && n <= UINT32_MAX;
+			opts->tenant_weight = n;
+		}
+		else if (name == "device_bytes")
+		{
+			ok = ParseOSLUint(value, &opts->device_bytes);
+		}
+		else if (name == "quota_bytes")
+		{
+			ok = ParseOSLUint(value, &opts->quota_bytes);
+		}
+		else
+		{
+			return Status::InvalidArgument("Unknown OSL URI option", name);
+		}
+
+		if (!ok)
+		{
+			return Status::InvalidArgument("Bad value for OSL URI option " + name, value);
+		}
+		return Status::OK();
+	}
+
+	Status ParseOSLEnvURI(const std::string &uri, std::string *dev_name,
+			OSLEnvOptions *opts)
+	{
+		static const std::string scheme = "osl://";
+
+		if (uri.compare(0, scheme.size(), scheme) != 0)
+		{
+			return Status::InvalidArgument("OSL URI must start with osl://", uri);
+		}
+
+		size_t query = uri.find('?', scheme.size());
+		if (query == std::string::npos)
+		{
+			query = uri.size();
+		}
+
+		*dev_name = uri.substr(scheme.size(), query - scheme.size());
+		if (dev_name->empty())
+		{
+			return Status::InvalidArgument("OSL URI names no device", uri);
+		}
+
+		size_t start = query + 1;
+		while (start < uri.size())
+		{
+			size_t end = uri.find('&', start);
+			if (end == std::string::npos)
+			{
+				end = uri.size();
+			}
+
+			std::string option = uri.substr(start, end - start);
+			start = end + 1;
+			if (option.empty())
+			{
+				continue;
+			}
+
+			size_t eq = option.find('=');
+			if (eq == std::string::npos)
+			{
+				return Status::InvalidArgument("OSL URI option without a value", option);
+			}
+
+			Status s = SetOSLEnvOption(option.substr(0, eq), option.substr(eq + 1), opts);
+			if (!s.ok())
+			{
+				return s;
+			}
+		}
+
+		return Status::OK();
+	}
+
+	static OSLEnv *NewOSLEnvFromURI(const std::string &uri, std::string *errmsg)
+	{
+		std::string dev_name;
+		OSLEnvOptions opts;
+		Env *env = nullptr;
+
+		Status s = ParseOSLEnvURI(uri, &dev_name, &opts);
+		if (s.ok())
+		{
+			s = NewOSLEnv(&env, dev_name, opts);
+		}
+		if (!s.ok())
+		{
+			*errmsg = s.ToString();
+			return nullptr;
+		}
+
+		return static_cast<OSLEnv *>(env);
+	}
+
+	/* ### FileSystem view, for --fs_uri ### */
+
+	/* Presents an OSLEnv it owns through the FileSystem interface. */
+	class OSLFileSystem : public LegacyFileSystemWrapper
+	{
+		public:
+			explicit OSLFileSystem(OSLEnv *env)
+				: LegacyFileSystemWrapper(env), env_(env)
+			{
+			}
+
+			static const char *kClassName()
+			{
+				return "OSLFileSystem";
+			}
+
+			const char *Name() const override
+			{
+				return kClassName();
+			}
+
+		private:
+			std::unique_ptr<OSLEnv> env_;
+	};
+
+} // namespace rocksdb
+
+/* Named by osl_FUNC in osl.mk; RocksDB declares it extern "C" in the
+ * generated build_version.cc. */
+extern "C" int register_OSLObjects(rocksdb::ObjectLibrary &library,
+		const std::string & /* arg */)
+{
+	library.AddFactory<rocksdb::Env>(
+			rocksdb::ObjectLibrary::PatternEntry("osl", false).AddSeparator("://", false),
+			[](const std::string &uri, std::unique_ptr<rocksdb::Env> *guard,
+				std::string *errmsg) {
+			guard->reset(rocksdb::NewOSLEnvFromURI(uri, errmsg));
+			return guard->get();
+			});
+
+	library.AddFactory<rocksdb::FileSystem>(
+			rocksdb::ObjectLibrary::PatternEntry("osl", false).AddSeparator("://", false),
+			[](const std::string &uri, std::unique_ptr<rocksdb::FileSystem> *guard,
+				std::string *errmsg) {
+			rocksdb::OSLEnv *env = rocksdb::NewOSLEnvFromURI(uri, errmsg);
+			guard->reset(env ? new rocksdb::OSLFileSystem(env) : nullptr);
+			return guard->get();
+			});
+
+	return 2;
+}
@@ -0,0 +1,259 @@
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+
+#include "env_osl.h"
+
+namespace rocksdb
+{
+
+	/* Pool of the thread running the current job (-1 = not an env job). */
+	static thread_local int osl_thread_pool = -1;
+
+	static std::uint64_t SchedNowMicros()
+	{
+		return std::chrono::duration_cast<std::chrono::microseconds>(
+				std::chrono::steady_clock::now().time_since_epoch())
+			.count();
+	}
+
+	/* ### OSLIOScheduler ### */
+
+	OSLIOScheduler::OSLIOScheduler(int queue_depth)
+		: next_tenant_(0),
+		queue_depth_(std::max(queue_depth, 1)),
+		inflight_(0),
+		vclock_(0)
+	{
+	}
+
+	int OSLIOScheduler::AddTenant(std::uint32_t weight,
+			std::uint64_t bg_write_bytes_per_sec)
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		Tenant &tenant = tenants_[next_tenant_];
+
+		tenant.weight = std::max<std::uint32_t>(weight, 1);
+		tenant.vtime = vclock_;
+		tenant.rate = bg_write_bytes_per_sec;
+		tenant.tokens = 0;
+		tenant.last_refill_us = SchedNowMicros();
+		return next_tenant_++;
+	}
+
+	void OSLIOScheduler::RemoveTenant(int tenant)
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		tenants_.erase(tenant);
+	}
+
+	void OSLIOScheduler::SetBackgroundWriteRate(int tenant,
+			std::uint64_t bytes_per_sec)
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		Tenant &t = tenants_.at(tenant);
+
+		RefillTokens(&t);
+		t.rate = bytes_per_sec;
+		cv_.notify_all();
+	}
+
+	void OSLIOScheduler::RefillTokens(Tenant *tenant)
+	{
+		std::uint64_t now = SchedNowMicros();
+
+		if (tenant->rate != 0)
+		{
+			/* Burst of at most 100ms worth of bandwidth. */
+			double burst = std::max<double>(tenant->rate / 10.0, OSL_SCHED_CHUNK);
+			tenant->tokens += (double)(now - tenant->last_refill_us) *
+				tenant->rate / 1000000.0;
+			tenant->tokens = std::min(tenant->tokens, burst);
+		}
+		tenant->last_refill_us = now;
+	}
+
+	std::uint64_t OSLIOScheduler::TokenWaitMicros(const Tenant *tenant)
+	{
+		if (tenant->rate == 0 || tenant->tokens > 0)
+		{
+			return 0;
+		}
+		return (std::uint64_t)(-tenant->tokens * 1000000.0 / tenant->rate) + 1;
+	}
+
+	bool OSLIOScheduler::Throttled(const Waiter *w)
+	{
+		return w->throttled && w->tenant->rate != 0 && w->tenant->tokens <= 0;
+	}
+
+	/* Only the oldest waiter of each tenant in a class is a candidate, so a
+	 * tenant's requests are granted in order. A throttled background write
+	 * holds back its own tenant only, and never the classes behind it. */
+	const OSLIOScheduler::Waiter *OSLIOScheduler::NextGrant()
+	{
+		std::vector<const Tenant *> seen;
+
+		for (auto it = tenants_.begin(); it != tenants_.end(); it++)
+		{
+			RefillTokens(&it->second);
+		}
+
+		for (int c = 0; c < OSL_IO_CLASSES; c++)
+		{
+			const Waiter *best = NULL;
+
+			seen.clear();
+			for (const Waiter *w : queues_[c])
+			{
+				if (std::find(seen.begin(), seen.end(), w->tenant) != seen.end())
+				{
+					continue;
+				}
+				seen.push_back(w->tenant);
+
+				if (!Throttled(w) &&
+						(best == NULL || w->tenant->vtime < best->tenant->vtime))
+				{
+					best = w;
+				}
+			}
+
+			if (best)
+			{
+				return best;
+			}
+		}
+
+		return NULL;
+	}
+
+	void OSLIOScheduler::Acquire(int tenant, OSLIOClass io_class, size_t bytes,
+			bool is_write)
+	{
+		Waiter w;
+		w.io_class = io_class;
+		w.bytes = bytes;
+		w.throttled = is_write &&
+			(io_class == OSL_IO_FLUSH || io_class == OSL_IO_COMPACTION);
+
+		std::unique_lock<std::mutex> lock(mutex_);
+		w.tenant = &tenants_.at(tenant);
+		w.tenant->vtime = std::max(w.tenant->vtime, vclock_);
+		queues_[io_class].push_back(&w);
+
+		while (inflight_ >= queue_depth_ || NextGrant() != &w)
+		{
+			std::uint64_t wait_us = w.throttled ? TokenWaitMicros(w.tenant) : 0;
+			if (wait_us)
+			{
+				cv_.wait_for(lock, std::chrono::microseconds(wait_us));
+			}
+			else
+			{
+				cv_.wait(lock);
+			}
+		}
+
+		std::deque<Waiter *> &queue = queues_[io_class];
+		queue.erase(std::find(queue.begin(), queue.end(), &w));
+		inflight_++;
+
+		/* A slot held for a whole device-side job still costs a page. */
+		vclock_ = w.tenant->vtime;
+		w.tenant->vtime += (double)std::max<size_t>(bytes, OSL_ALIGMENT) /
+			w.tenant->weight;
+		if (w.throttled && w.tenant->rate != 0)
+		{
+			w.tenant->tokens -= (double)bytes;
+		}
+
+		/* Another slot may still be free for the next waiter. */
+		cv_.notify_all();
+	}
+
+	void OSLIOScheduler::Release()
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		inflight_--;
+		cv_.notify_all();
+	}
+
+	void OSLIOScheduler::SetThreadPool(int pri)
+	{
+		osl_thread_pool = pri;
+	}
+
+	OSLIOClass OSLIOScheduler::ThreadReadClass()
+	{
+		switch (osl_thread_pool)
+		{
+			case Env::Priority::BOTTOM:
+			case Env::Priority::LOW:
+				return OSL_IO_COMPACTION;
+			case Env::Priority::HIGH:
+				return OSL_IO_FLUSH;
+			default:
+				return OSL_IO_USER_READ;
+		}
+	}
+
+	OSLIOClass OSLIOScheduler::ThreadWriteClass()
+	{
+		switch (osl_thread_pool)
+		{
+			case Env::Priority::BOTTOM:
+			case Env::Priority::LOW:
+				return OSL_IO_COMPACTION;
+			default:
+				return OSL_IO_FLUSH;
+		}
+	}
+
+	/* ### Job tagging ### */
+
+	struct OSLScheduledJob
+	{
+		void (*function)(void *arg);
+		void *arg;
+		void (*unschedFunction)(void *arg);
+		Env::Priority pri;
+	};
+
+	static void RunOSLScheduledJob(void *arg)
+	{
+		OSLScheduledJob *job = reinterpret_cast<OSLScheduledJob *>(arg);
+
+		OSLIOScheduler::SetThreadPool(job->pri);
+		job->function(job->arg);
+		OSLIOScheduler::SetThreadPool(-1);
+
+		delete job;
+	}
+
+	static void UnscheduleOSLScheduledJob(void *arg)
+	{
+		OSLScheduledJob *job = reinterpret_cast<OSLScheduledJob *>(arg);
+
+		if (job->unschedFunction)
+		{
+			job->unschedFunction(job->arg);
+		}
+
+		delete job;
+	}
+
+	void OSLEnv::Schedule(void (*function)(void *arg), void *arg, Priority pri,
+			void *tag, void (*unschedFunction)(void *arg))
+	{
+		OSLScheduledJob *job = new OSLScheduledJob();
+		job->function = function;
+		job->arg = arg;
+		job->unschedFunction = unschedFunction;
+		job->pri = pri;
+
+		posixEnv->Schedule(&RunOSLScheduledJob, job, pri, tag,
+				&UnscheduleOSLScheduledJob);
+	}
+
+} // namespace rocksdb
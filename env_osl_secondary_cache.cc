@@ -0,0 +1,463 @@
+#include <string.h>
+
+#include <iostream>
+
+#include "env_osl_secondary_cache.h"
+#include "util/coding.h"
+#include "util/compression.h"
+#include "util/crc32c.h"
+#include "util/hash.h"
+
+namespace rocksdb
+{
+
+	/* Record header: seq(8) key_len(4) stored_len(4) raw_len(4) crc(4) type(1) */
+	static const size_t kOSLRecordHeader = 32;
+
+	struct OSLSecondaryCache::LookupState
+	{
+		std::mutex mutex;
+		std::condition_variable cv;
+		bool ready = false;
+		void *value = nullptr;
+		size_t charge = 0;
+
+		void Complete(void *v, size_t c)
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			value = v;
+			charge = c;
+			ready = true;
+			cv.notify_all();
+		}
+	};
+
+	class OSLSecondaryCacheResultHandle : public SecondaryCacheResultHandle
+	{
+		public:
+			typedef OSLSecondaryCache::LookupState State;
+
+			explicit OSLSecondaryCacheResultHandle(std::shared_ptr<State> state)
+				: state_(state)
+			{
+			}
+
+			bool IsReady() override
+			{
+				std::lock_guard<std::mutex> lock(state_->mutex);
+				return state_->ready;
+			}
+
+			void Wait() override
+			{
+				std::unique_lock<std::mutex> lock(state_->mutex);
+				state_->cv.wait(lock, [this] { return state_->ready; });
+			}
+
+			void *Value() override
+			{
+				return state_->value;
+			}
+
+			size_t Size() override
+			{
+				return state_->charge;
+			}
+
+		private:
+			std::shared_ptr<State> state_;
+	};
+
+	OSLSecondaryCache::OSLSecondaryCache(OSLEnv *env,
+			const OSLSecondaryCacheOptions &opts)
+		: env_(env), options_(opts), head_(0), next_seq_(1), shutdown_(false)
+	{
+		size_t capacity = options_.capacity;
+		if (capacity == 0)
+		{
+			capacity = env_->GetFreeBytes() / 4;
+		}
+
+		size_t slots = capacity / OSL_ALIGMENT;
+		Status s = slots ? env_->AllocateLBAs(slots, &lbas_)
+			: Status::NoSpace("OSL secondary cache has no capacity");
+
+		if (!s.ok())
+		{
+			std::cout << "OSLSecondaryCache: cannot reserve " << slots
+				<< " lbas: " << s.ToString() << std::endl;
+			lbas_.clear();
+		}
+		slot_owner_.resize(lbas_.size(), 0);
+
+		for (int i = 0; i < options_.lookup_threads; i++)
+		{
+			workers_.emplace_back(&OSLSecondaryCache::WorkerLoop, this);
+		}
+	}
+
+	OSLSecondaryCache::~OSLSecondaryCache()
+	{
+		{
+			std::lock_guard<std::mutex> lock(work_mutex_);
+			shutdown_ = true;
+		}
+		work_cv_.notify_all();
+
+		for (auto &t : workers_)
+		{
+			t.join();
+		}
+
+		env_->FreeLBAs(lbas_);
+	}
+
+	std::uint64_t OSLSecondaryCache::KeyHash(const Slice &key)
+	{
+		std::uint64_t hash = Hash64(key.data(), key.size());
+		return hash ? hash : 1;
+	}
+
+	void OSLSecondaryCache::WorkerLoop()
+	{
+		env_->PinThreadToDevice();
+
+		for (;;)
+		{
+			std::function<void()> job;
+			{
+				std::unique_lock<std::mutex> lock(work_mutex_);
+				work_cv_.wait(lock, [this] { return shutdown_ || !work_.empty(); });
+				if (work_.empty())
+				{
+					return;
+				}
+				job = std::move(work_.front());
+				work_.pop_front();
+			}
+			job();
+		}
+	}
+
+	Status OSLSecondaryCache::Insert(const Slice &key, void *value,
+			const Cache::CacheItemHelper *helper)
+	{
+		if (lbas_.empty())
+		{
+			return Status::OK();
+		}
+
+		size_t size = helper->size_cb(value);
+		size_t raw_off = kOSLRecordHeader + key.size();
+
+		/* Blocks larger than one bounce buffer are not worth a device record. */
+		if (raw_off + size > OSL_BOUNCE_BUF)
+		{
+			return Status::OK();
+		}
+
+		char *buf = env_->BounceBuffer();
+		if (!buf)
+		{
+			return Status::IOError("OSL bounce buffer allocation failed");
+		}
+
+		Status s = helper->saveto_cb(value, 0, size, buf + raw_off);
+		if (!s.ok())
+		{
+			return s;
+		}
+
+		CompressionType type = kNoCompression;
+		size_t stored = size;
+
+		if (options_.compression_type != kNoCompression)
+		{
+			CompressionOptions compression_opts;
+			CompressionContext compression_context(options_.compression_type);
+			CompressionInfo compression_info(compression_opts, compression_context,
+					CompressionDict::GetEmptyDict(), options_.compression_type, 0);
+			std::string compressed;
+
+			if (CompressData(Slice(buf + raw_off, size), compression_info,
+						options_.compress_format_version, &compressed) &&
+					compressed.size() < size)
+			{
+				memcpy(buf + raw_off, compressed.data(), compressed.size());
+				type = options_.compression_type;
+				stored = compressed.size();
+			}
+		}
+
+		memcpy(buf + kOSLRecordHeader, key.data(), key.size());
+
+		size_t total = raw_off + stored;
+		std::uint32_t pages = (total + OSL_ALIGMENT - 1) / OSL_ALIGMENT;
+		std::uint64_t hash = KeyHash(key);
+		Entry entry;
+
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+
+			if (pages > lbas_.size())
+			{
+				return Status::OK();
+			}
+
+			entry.seq = next_seq_++;
+			entry.slot = head_;
+			entry.pages = pages;
+			entry.pending = true;
+
+			for (std::uint32_t i = 0; i < pages; i++)
+			{
+				std::uint32_t slot = (head_ + i) % lbas_.size();
+				std::uint64_t owner = slot_owner_[slot];
+
+				if (owner)
+				{
+					/* The owner may have been re-inserted elsewhere already. */
+					auto it = index_.find(owner);
+					if (it != index_.end() &&
+							(slot + lbas_.size() - it->second.slot) % lbas_.size() <
+							it->second.pages)
+					{
+						index_.erase(it);
+					}
+				}
+				slot_owner_[slot] = hash;
+			}
+
+			/* The slots are claimed, but lookups miss the entry until its
+			 * pages are on the device; an eviction meanwhile drops it. */
+			head_ = (head_ + pages) % lbas_.size();
+			index_[hash] = entry;
+		}
+
+		EncodeFixed64(buf, entry.seq);
+		EncodeFixed32(buf + 8, (uint32_t)key.size());
+		EncodeFixed32(buf + 12, (uint32_t)stored);
+		EncodeFixed32(buf + 16, (uint32_t)size);
+		EncodeFixed32(buf + 20,
+				crc32c::Value(buf + kOSLRecordHeader, key.size() + stored));
+		buf[24] = (char)type;
+
+		/* Evictions happen on the reading thread, so cache fills are not
+		 * charged to the background write budget. */
+		OSLIOGrant grant(env_->GetIOScheduler(), env_->GetIOTenant(),
+				OSL_IO_FLUSH, false);
+
+		for (std::uint32_t i = 0; i < pages; i++)
+		{
+			grant.Page((pages - i) * OSL_ALIGMENT);
+			s = env_->WriteLBA(lbas_[(entry.slot + i) % lbas_.size()],
+					buf + i * OSL_ALIGMENT);
+			if (!s.ok())
+			{
+				std::lock_guard<std::mutex> lock(mutex_);
+				auto it = index_.find(hash);
+				if (it != index_.end() && it->second.seq == entry.seq)
+				{
+					index_.erase(it);
+				}
+				return s;
+			}
+		}
+
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			auto it = index_.find(hash);
+			if (it != index_.end() && it->second.seq == entry.seq)
+			{
+				it->second.pending = false;
+			}
+		}
+
+		return Status::OK();
+	}
+
+	std::unique_ptr<SecondaryCacheResultHandle> OSLSecondaryCache::Lookup(
+			const Slice &key, const Cache::CreateCallback &create_cb, bool wait,
+			bool advise_erase, bool &is_in_sec_cache)
+	{
+		std::uint64_t hash = KeyHash(key);
+		Entry entry;
+
+		is_in_sec_cache = false;
+
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+
+			auto it = index_.find(hash);
+			if (it == index_.end() || it->second.pending)
+			{
+				return nullptr;
+			}
+
+			entry = it->second;
+			if (advise_erase)
+			{
+				index_.erase(it);
+			}
+		}
+
+		is_in_sec_cache = !advise_erase;
+
+		std::shared_ptr<LookupState> state = std::make_shared<LookupState>();
+		std::unique_ptr<SecondaryCacheResultHandle> handle(
+				new OSLSecondaryCacheResultHandle(state));
+
+		if (wait || workers_.empty())
+		{
+			ReadEntry(key.ToString(), entry, create_cb, state.get());
+			return handle;
+		}
+
+		std::string key_copy = key.ToString();
+		Cache::CreateCallback cb = create_cb;
+		{
+			std::lock_guard<std::mutex> lock(work_mutex_);
+			work_.push_back([this, key_copy, entry, cb, state]() {
+					ReadEntry(key_copy, entry, cb, state.get());
+					});
+		}
+		work_cv_.notify_one();
+
+		return handle;
+	}
+
+	/* Reads one record back and hands the value to create_cb. A record that
+	 * was overwritten after the index lookup fails the seq or key check and
+	 * is reported as a miss. */
+	void OSLSecondaryCache::ReadEntry(const std::string &key, const Entry &entry,
+			const Cache::CreateCallback &create_cb, LookupState *state)
+	{
+		char *buf = env_->BounceBuffer();
+
+		if (!buf)
+		{
+			state->Complete(nullptr, 0);
+			return;
+		}
+
+		OSLIOGrant grant(env_->GetIOScheduler(), env_->GetIOTenant(),
+				OSL_IO_USER_READ, false);
+
+		for (std::uint32_t i = 0; i < entry.pages; i++)
+		{
+			grant.Page((entry.pages - i) * OSL_ALIGMENT);
+			Status s = env_->ReadLBA(lbas_[(entry.slot + i) % lbas_.size()],
+					buf + i * OSL_ALIGMENT);
+			if (!s.ok())
+			{
+				state->Complete(nullptr, 0);
+				return;
+			}
+		}
+
+		std::uint64_t seq = DecodeFixed64(buf);
+		std::uint32_t key_len = DecodeFixed32(buf + 8);
+		std::uint32_t stored = DecodeFixed32(buf + 12);
+		std::uint32_t size = DecodeFixed32(buf + 16);
+		std::uint32_t crc = DecodeFixed32(buf + 20);
+		CompressionType type = (CompressionType)buf[24];
+		const char *data = buf + kOSLRecordHeader + key_len;
+
+		if (seq != entry.seq || key_len != key.size() ||
+				kOSLRecordHeader + key_len + stored > entry.pages * OSL_ALIGMENT ||
+				memcmp(buf + kOSLRecordHeader, key.data(), key_len) != 0)
+		{
+			state->Complete(nullptr, 0);
+			return;
+		}
+
+		if (crc32c::Value(buf + kOSLRecordHeader, key_len + stored) != crc)
+		{
+			std::cout << "OSLSecondaryCache: checksum mismatch at slot "
+				<< entry.slot << ", dropping record" << std::endl;
+
+			/* Only this record: the key may have been re-inserted since. */
+			{
+				std::lock_guard<std::mutex> lock(mutex_);
+				auto it = index_.find(KeyHash(key));
+				if (it != index_.end() && it->second.seq == entry.seq)
+				{
+					index_.erase(it);
+				}
+			}
+			state->Complete(nullptr, 0);
+			return;
+		}
+
+		CacheAllocationPtr uncompressed;
+		if (type != kNoCompression)
+		{
+			UncompressionContext uncompression_context(type);
+			UncompressionInfo uncompression_info(uncompression_context,
+					UncompressionDict::GetEmptyDict(), type);
+			size_t uncompressed_size = 0;
+
+			uncompressed = UncompressData(uncompression_info, data, stored,
+					&uncompressed_size, options_.compress_format_version, nullptr);
+			if (!uncompressed || uncompressed_size != size)
+			{
+				state->Complete(nullptr, 0);
+				return;
+			}
+			data = uncompressed.get();
+		}
+
+		void *value = nullptr;
+		size_t charge = 0;
+		Status s = create_cb(data, size, &value, &charge);
+		if (!s.ok())
+		{
+			state->Complete(nullptr, 0);
+			return;
+		}
+
+		state->Complete(value, charge);
+	}
+
+	void OSLSecondaryCache::Erase(const Slice &key)
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		index_.erase(KeyHash(key));
+	}
+
+	void OSLSecondaryCache::WaitAll(std::vector<SecondaryCacheResultHandle *> handles)
+	{
+		for (SecondaryCacheResultHandle *handle : handles)
+		{
+			handle->Wait();
+		}
+	}
+
+	std::string OSLSecondaryCache::GetPrintableOptions() const
+	{
+		std::string ret;
+
+		ret.append("    capacity: " + std::to_string(lbas_.size() * OSL_ALIGMENT) + "\n");
+		ret.append("    compression_type: " +
+				CompressionTypeToString(options_.compression_type) + "\n");
+		ret.append("    compress_format_version: " +
+				std::to_string(options_.compress_format_version) + "\n");
+		ret.append("    lookup_threads: " +
+				std::to_string(options_.lookup_threads) + "\n");
+		return ret;
+	}
+
+	std::shared_ptr<SecondaryCache> NewOSLSecondaryCache(OSLEnv *env,
+			const OSLSecondaryCacheOptions &opts)
+	{
+		std::shared_ptr<OSLSecondaryCache> cache =
+			std::make_shared<OSLSecondaryCache>(env, opts);
+
+		if (!cache->Reserved())
+		{
+			return nullptr;
+		}
+		return cache;
+	}
+
+} // namespace rocksdb
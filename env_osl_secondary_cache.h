@@ -0,0 +1,118 @@
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "env_osl.h"
+#include "rocksdb/cache.h"
+#include "rocksdb/secondary_cache.h"
+
+namespace rocksdb
+{
+
+	/* ### OSL Secondary Cache ### */
+
+	struct OSLSecondaryCacheOptions
+	{
+		/* Device space reserved for the cache, rounded down to whole LBAs;
+		 * 0 takes a quarter of what the env can still allocate. */
+		size_t capacity = 0;
+
+		/* Blocks are stored compressed when it saves at least one byte. */
+		CompressionType compression_type = kLZ4Compression;
+		uint32_t compress_format_version = 2;
+
+		/* Threads serving Lookup(wait = false). */
+		int lookup_threads = 4;
+	};
+
+	/* Stores blocks evicted from the block cache in a ring of LBAs reserved
+	 * from the OSLEnv allocator. Each block is written as one record (header,
+	 * key, value) over consecutive ring slots; the in-memory index only keeps
+	 * the key hash and the record position, and the key stored on the device
+	 * resolves hash collisions. Writing over a slot evicts its old record. */
+	class OSLSecondaryCache : public SecondaryCache
+	{
+		public:
+			OSLSecondaryCache(OSLEnv *env, const OSLSecondaryCacheOptions &opts);
+
+			~OSLSecondaryCache() override;
+
+			const char *Name() const override
+			{
+				return "OSLSecondaryCache";
+			}
+
+			Status Insert(const Slice &key, void *value,
+					const Cache::CacheItemHelper *helper) override;
+
+			std::unique_ptr<SecondaryCacheResultHandle> Lookup(const Slice &key,
+					const Cache::CreateCallback &create_cb, bool wait,
+					bool advise_erase, bool &is_in_sec_cache) override;
+
+			bool SupportForceErase() const override
+			{
+				return true;
+			}
+
+			void Erase(const Slice &key) override;
+
+			void WaitAll(std::vector<SecondaryCacheResultHandle *> handles) override;
+
+			std::string GetPrintableOptions() const override;
+
+			/* False if the capacity could not be reserved on the device. */
+			bool Reserved() const
+			{
+				return !lbas_.empty();
+			}
+
+			/* Completion state shared by a result handle and its reader. */
+			struct LookupState;
+
+		private:
+			struct Entry
+			{
+				std::uint64_t seq;
+				std::uint32_t slot;
+				std::uint32_t pages;
+				/* Set until Insert has written the pages; Lookup skips it. */
+				bool pending;
+			};
+
+			OSLEnv *env_;
+			const OSLSecondaryCacheOptions options_;
+
+			std::mutex mutex_;
+			std::vector<uint32_t> lbas_;
+			std::vector<std::uint64_t> slot_owner_;
+			std::unordered_map<std::uint64_t, Entry> index_;
+			std::uint32_t head_;
+			std::uint64_t next_seq_;
+
+			std::mutex work_mutex_;
+			std::condition_variable work_cv_;
+			std::deque<std::function<void()>> work_;
+			std::vector<std::thread> workers_;
+			bool shutdown_;
+
+			static std::uint64_t KeyHash(const Slice &key);
+
+			void ReadEntry(const std::string &key, const Entry &entry,
+					const Cache::CreateCallback &create_cb, LookupState *state);
+
+			void WorkerLoop();
+	};
+
+	/* Returns nullptr if the cache cannot reserve its capacity. */
+	std::shared_ptr<SecondaryCache> NewOSLSecondaryCache(OSLEnv *env,
+			const OSLSecondaryCacheOptions &opts);
+
+} // namespace rocksdb
@@ -0,0 +1,273 @@
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <set>
+
+#include "env_osl.h"
+
+namespace rocksdb
+{
+
+	static const std::string kOSLTierSuffix = ".osl";
+
+	static bool EndsWith(const std::string &s, const std::string &suffix)
+	{
+		return s.size() >= suffix.size() &&
+			s.compare(s.size() - suffix.size(), suffix.size(), suffix) == 0;
+	}
+
+	/* Only finished SSTs are copied: they are never written again, so the
+	 * copy stays in step with the device pages. */
+	static bool IsTierCandidate(const std::string &fname, const OSLFile *oslfile)
+	{
+		return EndsWith(fname, ".sst") && !oslfile->packed &&
+			oslfile->synced_size > 0 && oslfile->synced_size == oslfile->size;
+	}
+
+	/* ### Migrator thread ### */
+
+	void OSLEnv::StartTiering()
+	{
+		std::vector<std::string> children;
+
+		posixEnv->CreateDirIfMissing(env_options.tier_path);
+		if (posixEnv->GetChildren(env_options.tier_path, &children).ok())
+		{
+			for (const std::string &child : children)
+			{
+				if (EndsWith(child, kOSLTierSuffix))
+				{
+					posixEnv->DeleteFile(env_options.tier_path + "/" + child);
+				}
+			}
+		}
+
+		tier_thread = std::thread(&OSLEnv::TierLoop, this);
+	}
+
+	void OSLEnv::StopTiering()
+	{
+		if (!tier_thread.joinable())
+		{
+			return;
+		}
+
+		{
+			std::lock_guard<std::mutex> lock(tier_wait_mutex);
+			tier_shutdown = true;
+			tier_cv.notify_all();
+		}
+		tier_thread.join();
+	}
+
+	void OSLEnv::TierLoop()
+	{
+		PinThreadToDevice();
+
+		/* Copies are scheduled like compaction I/O. */
+		OSLIOScheduler::SetThreadPool(Env::Priority::LOW);
+
+		std::unique_lock<std::mutex> lock(tier_wait_mutex);
+		for (;;)
+		{
+			tier_cv.wait_for(lock,
+					std::chrono::seconds(std::max(env_options.tier_interval_sec, 1)),
+					[&] { return tier_shutdown; });
+			if (tier_shutdown)
+			{
+				return;
+			}
+
+			lock.unlock();
+			Status s = MigrateTiers();
+			if (!s.ok())
+			{
+				std::cout << __func__ << " " << env_options.tier_path << ": "
+					<< s.ToString() << std::endl;
+			}
+			lock.lock();
+		}
+	}
+
+	/* ### Promotion and demotion ### */
+
+	Status OSLEnv::MigrateTiers()
+	{
+		std::vector<std::pair<std::uint64_t, OSLFile *>> promote;
+		std::vector<OSLFile *> demote;
+		std::uint64_t threshold = env_options.tier_promote_score;
+
+		{
+			std::lock_guard<std::mutex> lock(files_mutex);
+			std::set<OSLFile *> seen;
+
+			for (auto it = files.begin(); it != files.end(); it++)
+			{
+				OSLFile *oslfile = it->second;
+				if (oslfile == NULL || !seen.insert(oslfile).second)
+				{
+					continue;
+				}
+
+				/* Long-lived files pay a copy back over more reads. */
+				std::uint64_t score;
+				{
+					std::lock_guard<std::mutex> heat_lock(oslfile->heat_mutex);
+					score = (std::uint64_t)oslfile->temperature *
+						(oslfile->level < 0 ? 1 : oslfile->level + 1);
+					oslfile->temperature /= 2;
+				}
+
+				if (oslfile->local)
+				{
+					if (score < threshold / 4)
+					{
+						oslfile->Ref();
+						demote.push_back(oslfile);
+					}
+				}
+				else if (score >= threshold && IsTierCandidate(it->first, oslfile))
+				{
+					oslfile->Ref();
+					promote.push_back(std::make_pair(score, oslfile));
+				}
+			}
+		}
+
+		for (OSLFile *oslfile : demote)
+		{
+			DemoteFile(oslfile);
+		}
+
+		std::stable_sort(promote.begin(), promote.end(),
+				[](const std::pair<std::uint64_t, OSLFile *> &a,
+					const std::pair<std::uint64_t, OSLFile *> &b) {
+				return a.first > b.first;
+				});
+
+		Status s;
+		for (auto &candidate : promote)
+		{
+			OSLFile *oslfile = candidate.second;
+			std::uint64_t size = 0;
+			bool fits = false;
+			{
+				/* Room is reserved up front and given back if the copy fails. */
+				std::lock_guard<std::mutex> lock(files_mutex);
+				size = oslfile->synced_size;
+				fits = s.ok() && tier_bytes + size <= env_options.tier_capacity;
+				if (fits)
+				{
+					tier_bytes += size;
+				}
+			}
+
+			if (fits)
+			{
+				s = PromoteFile(oslfile, size);
+			}
+			UnrefFile(oslfile);
+		}
+
+		return s;
+	}
+
+	/* Copies the first size bytes of oslfile to the tier, verified page by
+	 * page on the way, and switches its reads over. The caller holds a
+	 * reference to oslfile. */
+	Status OSLEnv::PromoteFile(OSLFile *oslfile, std::uint64_t size)
+	{
+		std::string path = env_options.tier_path + "/" +
+			std::to_string(oslfile->uuididx) + kOSLTierSuffix;
+		std::unique_ptr<WritableFile> out;
+		std::unique_ptr<RandomAccessFile> in;
+
+		char *buf = AllocIOBuffer(OSL_HUGE_PAGE);
+		Status s = buf ? posixEnv->NewWritableFile(path, &out, EnvOptions())
+			: Status::IOError("OSL tier buffer allocation failed");
+
+		for (std::uint64_t off = 0; s.ok() && off < size; off += OSL_HUGE_PAGE)
+		{
+			size_t len = std::min<std::uint64_t>(OSL_HUGE_PAGE, size - off);
+			s = ReadFileRange(oslfile, off, len, buf);
+			if (s.ok())
+			{
+				s = out->Append(Slice(buf, len));
+			}
+		}
+		if (s.ok())
+		{
+			s = out->Sync();
+		}
+		if (s.ok())
+		{
+			s = out->Close();
+		}
+		if (s.ok())
+		{
+			s = posixEnv->NewRandomAccessFile(path, &in, EnvOptions());
+		}
+		if (buf)
+		{
+			FreeIOBuffer(buf, OSL_HUGE_PAGE);
+		}
+
+		bool installed = false;
+		{
+			std::unique_lock<std::shared_mutex> tier_lock(oslfile->tier_mutex);
+			std::lock_guard<std::mutex> lock(files_mutex);
+
+			/* A file deleted during the copy is freed by our reference. */
+			if (s.ok() && oslfile->links > 0)
+			{
+				oslfile->local = std::move(in);
+				oslfile->local_path = path;
+				installed = true;
+			}
+			if (!installed)
+			{
+				tier_bytes -= size;
+			}
+		}
+
+		if (!installed)
+		{
+			posixEnv->DeleteFile(path);
+			if (!s.ok())
+			{
+				std::cout << __func__ << " file: " << path << " not promoted: "
+					<< s.ToString() << std::endl;
+			}
+		}
+		return s;
+	}
+
+	/* The device pages were never dropped, so demotion only has to wait
+	 * for the reads of the copy to drain. */
+	void OSLEnv::DemoteFile(OSLFile *oslfile)
+	{
+		std::unique_ptr<RandomAccessFile> local;
+		std::string path;
+
+		{
+			std::unique_lock<std::shared_mutex> tier_lock(oslfile->tier_mutex);
+			std::lock_guard<std::mutex> lock(files_mutex);
+
+			/* A file deleted meanwhile drops its copy when it is freed. */
+			if (oslfile->links > 0)
+			{
+				local.swap(oslfile->local);
+				path.swap(oslfile->local_path);
+				tier_bytes -= oslfile->synced_size;
+			}
+		}
+		UnrefFile(oslfile);
+
+		local.reset();
+		if (!path.empty())
+		{
+			posixEnv->DeleteFile(path);
+		}
+	}
+
+} // namespace rocksdb
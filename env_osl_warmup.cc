@@ -0,0 +1,352 @@
+#include <string.h>
+
+#include <algorithm>
+#include <atomic>
+#include <iostream>
+#include <set>
+#include <thread>
+
+#include "env_osl.h"
+#include "util/coding.h"
+#include "util/crc32c.h"
+
+namespace rocksdb
+{
+
+	/* Profile layout: magic(8) nregions(4), per region: name(length
+	 * prefixed) uuididx(8) region(4) reads(4), then the crc32c of
+	 * everything above(4). Regions are stored hottest first. */
+	static const char kOSLWarmupMagic[] = "OSLWU001";
+	static const size_t kOSLWarmupMagicLen = 8;
+
+	struct OSLWarmupRegion
+	{
+		std::string name;
+		std::uint64_t uuididx;
+		uint32_t region;
+		uint32_t reads;
+	};
+
+	static void EncodePageKey(char *key, const OSLFile *oslfile, size_t idx)
+	{
+		EncodeFixed64(key, oslfile->uuididx);
+		EncodeFixed64(key + 8, idx);
+	}
+
+	static void DeleteCachedPage(const Slice &key, void *value)
+	{
+		delete[] (char *)value;
+	}
+
+	/* ### Page cache ### */
+
+	Cache::Handle *OSLEnv::LookupPage(const OSLFile *oslfile, size_t idx)
+	{
+		if (!page_cache)
+		{
+			return nullptr;
+		}
+
+		char key[16];
+		EncodePageKey(key, oslfile, idx);
+		return page_cache->Lookup(Slice(key, sizeof(key)));
+	}
+
+	void OSLEnv::ErasePages(const OSLFile *oslfile, size_t first_idx)
+	{
+		if (!page_cache)
+		{
+			return;
+		}
+
+		char key[16];
+		for (size_t idx = first_idx; idx < oslfile->lbas.size(); idx++)
+		{
+			EncodePageKey(key, oslfile, idx);
+			page_cache->Erase(Slice(key, sizeof(key)));
+		}
+	}
+
+	Status OSLEnv::PrefetchPages(const OSLFile *oslfile, uint64_t offset, size_t n)
+	{
+		if (!page_cache || n == 0)
+		{
+			return Status::OK();
+		}
+
+		size_t block = oslfile->BlockSize();
+		size_t first = offset / block;
+		std::vector<OSLBlockRef> blocks;
+
+		/* Packed files have no pages of their own to cache, and only whole
+		 * blocks are. */
+		SnapshotBlocks(oslfile, first, (offset + n + block - 1) / block, &blocks);
+		while (!blocks.empty() && blocks.back().valid != block)
+		{
+			blocks.pop_back();
+		}
+		size_t limit = first + blocks.size();
+
+		if (first >= limit)
+		{
+			return Status::OK();
+		}
+
+		OSLIOGrant grant(GetIOScheduler(), GetIOTenant(),
+				OSLIOScheduler::ThreadReadClass(), false);
+		char *page = BounceBuffer();
+		if (page == NULL)
+		{
+			return Status::IOError("OSL bounce buffer allocation failed");
+		}
+
+		for (size_t idx = first; idx < limit; idx++)
+		{
+			char key[16];
+			EncodePageKey(key, oslfile, idx);
+
+			Cache::Handle *cached = page_cache->Lookup(Slice(key, sizeof(key)));
+			if (cached)
+			{
+				page_cache->Release(cached);
+				continue;
+			}
+
+			grant.Page((limit - idx) * block, block);
+			Status s = ReadLBA(blocks[idx - first].lba, page, oslfile->block_pages);
+			if (!s.ok())
+			{
+				return s;
+			}
+
+			if (crc32c::Value(page, block) != blocks[idx - first].crc)
+			{
+				std::cout << __func__ << " file: " << oslfile->name
+					<< " checksum mismatch on page " << idx << std::endl;
+				return Status::Corruption("OSL page checksum mismatch", oslfile->name);
+			}
+
+			char *copy = new char[block];
+			memcpy(copy, page, block);
+
+			/* On failure the cache has already run the deleter. */
+			s = page_cache->Insert(Slice(key, sizeof(key)), copy, block,
+					&DeleteCachedPage);
+			if (!s.ok())
+			{
+				return s;
+			}
+		}
+
+		return Status::OK();
+	}
+
+	/* ### Warmup profile ### */
+
+	Status OSLEnv::SaveWarmupProfile()
+	{
+		const std::string &path = env_options.warmup_profile_path;
+		std::vector<OSLWarmupRegion> regions;
+
+		if (path.empty())
+		{
+			return Status::OK();
+		}
+
+		{
+			std::lock_guard<std::mutex> lock(files_mutex);
+			std::set<OSLFile *> seen;
+
+			for (auto it = files.begin(); it != files.end(); it++)
+			{
+				OSLFile *oslfile = it->second;
+				if (!seen.insert(oslfile).second)
+				{
+					continue;
+				}
+
+				std::lock_guard<std::mutex> heat_lock(oslfile->heat_mutex);
+				for (size_t i = 0; i < oslfile->heat.size(); i++)
+				{
+					if (oslfile->heat[i])
+					{
+						regions.push_back(OSLWarmupRegion{it->first, oslfile->uuididx,
+								(uint32_t)i, oslfile->heat[i]});
+					}
+				}
+			}
+		}
+
+		std::stable_sort(regions.begin(), regions.end(),
+				[](const OSLWarmupRegion &a, const OSLWarmupRegion &b) {
+				return a.reads > b.reads;
+				});
+		regions.resize(std::min(regions.size(),
+					env_options.warmup_bytes / OSL_HEAT_REGION));
+
+		std::string data(kOSLWarmupMagic, kOSLWarmupMagicLen);
+		PutFixed32(&data, regions.size());
+		for (const OSLWarmupRegion &r : regions)
+		{
+			PutLengthPrefixedSlice(&data, r.name);
+			PutFixed64(&data, r.uuididx);
+			PutFixed32(&data, r.region);
+			PutFixed32(&data, r.reads);
+		}
+		PutFixed32(&data, crc32c::Value(data.data(), data.size()));
+
+		std::string tmp = path + ".tmp";
+		Status s = WriteStringToFile(posixEnv, data, tmp, true);
+		if (s.ok())
+		{
+			s = posixEnv->RenameFile(tmp, path);
+		}
+		if (!s.ok())
+		{
+			std::cout << __func__ << " cannot write " << path << ": "
+				<< s.ToString() << std::endl;
+		}
+		return s;
+	}
+
+	static Status ParseWarmupProfile(Slice input,
+			std::vector<OSLWarmupRegion> *regions)
+	{
+		if (input.size() < kOSLWarmupMagicLen + 4 ||
+				memcmp(input.data(), kOSLWarmupMagic, kOSLWarmupMagicLen) != 0)
+		{
+			return Status::Corruption("OSL warmup profile has a bad header");
+		}
+
+		uint32_t crc = DecodeFixed32(input.data() + input.size() - 4);
+		if (crc32c::Value(input.data(), input.size() - 4) != crc)
+		{
+			return Status::Corruption("OSL warmup profile checksum mismatch");
+		}
+
+		input.remove_prefix(kOSLWarmupMagicLen);
+		input.remove_suffix(4);
+
+		uint32_t count = 0;
+		if (!GetFixed32(&input, &count))
+		{
+			return Status::Corruption("OSL warmup profile truncated");
+		}
+
+		for (uint32_t i = 0; i < count; i++)
+		{
+			OSLWarmupRegion r;
+			Slice name;
+
+			if (!GetLengthPrefixedSlice(&input, &name) ||
+					!GetFixed64(&input, &r.uuididx) ||
+					!GetFixed32(&input, &r.region) ||
+					!GetFixed32(&input, &r.reads))
+			{
+				return Status::Corruption("OSL warmup profile truncated");
+			}
+			r.name = name.ToString();
+			regions->push_back(r);
+		}
+
+		return Status::OK();
+	}
+
+	Status OSLEnv::Warmup()
+	{
+		const std::string &path = env_options.warmup_profile_path;
+		std::string data;
+
+		if (path.empty() || !page_cache)
+		{
+			return Status::OK();
+		}
+
+		Status s = posixEnv->FileExists(path);
+		if (s.ok())
+		{
+			s = ReadFileToString(posixEnv, path, &data);
+		}
+
+		std::vector<OSLWarmupRegion> regions;
+		if (s.ok())
+		{
+			s = ParseWarmupProfile(data, &regions);
+		}
+		if (!s.ok())
+		{
+			if (!s.IsNotFound())
+			{
+				std::cout << __func__ << " " << path << ": " << s.ToString() << std::endl;
+			}
+			return s;
+		}
+
+		size_t budget = std::min(env_options.warmup_bytes,
+				env_options.page_cache_bytes) / OSL_HEAT_REGION;
+		std::vector<std::pair<const OSLFile *, uint32_t>> work;
+
+		{
+			std::lock_guard<std::mutex> lock(files_mutex);
+
+			for (const OSLWarmupRegion &r : regions)
+			{
+				auto it = files.find(r.name);
+
+				/* A file rewritten under the same name is a different file. */
+				if (work.size() >= budget || it == files.end() ||
+						it->second->uuididx != r.uuididx)
+				{
+					continue;
+				}
+
+				/* Half of the old heat carries over, so regions the block cache
+				 * keeps hidden from the env age out slowly instead of at once. */
+				OSLFile *oslfile = it->second;
+				std::lock_guard<std::mutex> heat_lock(oslfile->heat_mutex);
+				if (oslfile->heat.size() <= r.region)
+				{
+					oslfile->heat.resize(r.region + 1, 0);
+				}
+				oslfile->heat[r.region] += r.reads / 2;
+
+				work.push_back(std::make_pair(oslfile, r.region));
+			}
+		}
+
+		std::atomic<size_t> next(0);
+		std::mutex error_mutex;
+		std::vector<std::thread> threads;
+		int nthreads = std::min<size_t>(std::max(env_options.warmup_threads, 1),
+				work.size());
+
+		for (int t = 0; t < nthreads; t++)
+		{
+			threads.emplace_back([&]() {
+					PinThreadToDevice();
+					for (size_t i = next++; i < work.size(); i = next++)
+					{
+						Status ps = PrefetchPages(work[i].first,
+								(uint64_t)work[i].second * OSL_HEAT_REGION, OSL_HEAT_REGION);
+						if (!ps.ok())
+						{
+							std::lock_guard<std::mutex> lock(error_mutex);
+							if (s.ok())
+							{
+								s = ps;
+							}
+						}
+					}
+					});
+		}
+		for (auto &t : threads)
+		{
+			t.join();
+		}
+
+		std::cout << "OSL warmup: " << work.size() << " regions from " << path
+			<< (s.ok() ? "" : ", " + s.ToString()) << std::endl;
+		return s;
+	}
+
+} // namespace rocksdb
@@ -0,0 +1,15 @@
+# RocksDB plugin descriptor. Check this tree out as plugin/osl in a RocksDB
+# source tree and build the tools with it linked in:
+#
+#   ROCKSDB_PLUGINS=osl make db_bench
+#   ./db_bench --env_uri='osl://<device>?namespace_path=/var/osl/ns&page_cache_bytes=1073741824'
+#
+# --fs_uri takes the same URI. Options are the OSLEnvOptions field names.
+
+osl_SOURCES = env_osl.cc env_osl_compaction.cc env_osl_device.cc \
+	env_osl_emu.cc env_osl_io.cc env_osl_kv.cc env_osl_mem.cc \
+	env_osl_namespace.cc env_osl_pack.cc env_osl_queue.cc \
+	env_osl_registry.cc env_osl_sched.cc env_osl_secondary_cache.cc \
+	env_osl_tier.cc env_osl_warmup.cc
+osl_HEADERS = env_osl.h env_osl_compaction.h env_osl_emu.h env_osl_secondary_cache.h
+osl_FUNC = register_OSLObjects